@@ -6,14 +6,25 @@
 
 #include "App.h"
 
+#include <math.h>
+
 #include "DB.h"
+#include "app_log.h"
+#include "app_store.h"
+#include "bench.h"
+#include "boot_time.h"
+#include "heap_mon.h"
 #include "mgos.h"
 #include "mgos_hap.h"
 #include "mgos_mel_ac.h"
+#include "mel_stats.h"
+#include "trace.h"
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 /**
- * Domain used in the key value store for application data.
+ * Domain used in the key value store for application data by older firmware.
+ * The records are now kept by the app store (app_store.h), which moves them
+ * out of this domain on first use.
  *
  * Purged: On factory reset.
  */
@@ -21,15 +32,130 @@
   ((HAPPlatformKeyValueStoreDomain) 0x00)
 
 /**
- * Key used in the key value store to store the configuration state.
+ * Key used in the app store to store the configuration state.
  *
  * Purged: On factory reset.
  */
 #define kAppKeyValueStoreKey_Configuration_State \
   ((HAPPlatformKeyValueStoreDomain) 0x00)
 
+/**
+ * Key used in the app store to store the last confirmed HVAC state.
+ *
+ * Purged: On factory reset.
+ */
+#define kAppKeyValueStoreKey_Configuration_HVACState \
+  ((HAPPlatformKeyValueStoreDomain) 0x01)
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
+/**
+ * Characteristics that support event notifications.
+ */
+typedef enum {
+  kAppCharacteristic_ThermostatCurrentHCstate,
+  kAppCharacteristic_ThermostatTargetHCstate,
+  kAppCharacteristic_ThermostatCurrentTemp,
+  kAppCharacteristic_ThermostatTargetTemp,
+  kAppCharacteristic_ThermostatTemperatureDisplayUnits,
+  kAppCharacteristic_ThermostatStatusActive,
+  kAppCharacteristic_FanActive,
+  kAppCharacteristic_FanCurrentState,
+  kAppCharacteristic_FanTargetState,
+  kAppCharacteristic_FanRotationSpeed,
+  kAppCharacteristic_FanStatusActive,
+  kAppCharacteristic_VaneVertCurrentState,
+  kAppCharacteristic_VaneVertCurrentTiltAngle,
+  kAppCharacteristic_VaneVertTargetTiltAngle,
+  kAppCharacteristic_VaneVertSwingMode,
+  kAppCharacteristic_VaneVertStatusActive,
+  kAppCharacteristic_VaneHorizCurrentState,
+  kAppCharacteristic_VaneHorizCurrentTiltAngle,
+  kAppCharacteristic_VaneHorizTargetTiltAngle,
+  kAppCharacteristic_VaneHorizSwingMode,
+  kAppCharacteristic_VaneHorizStatusActive,
+  kAppCharacteristic_ModeFanOn,
+  kAppCharacteristic_ModeFanStatusActive,
+  kAppCharacteristic_ModeDryOn,
+  kAppCharacteristic_ModeDryStatusActive,
+  kAppCharacteristic_Count
+} AppCharacteristic;
+
+/**
+ * Characteristic values as seen by the controllers.
+ *
+ * All formats used by the accessory (bool, uint8, tilt angles, temperatures)
+ * are represented exactly by a float.
+ */
+typedef struct {
+  float values[kAppCharacteristic_Count];
+} AccessoryState;
+
+/**
+ * Token bucket per rate limited characteristic. A change is raised when a
+ * token is available or the value moved by at least the deadband from what
+ * controllers last got; otherwise it is held and raised by a timer once a
+ * token is refilled, so the final value is always delivered.
+ */
+typedef struct {
+  AppCharacteristic characteristic;
+  int (*getIntervalMs)(void);
+  int (*getBurst)(void);
+  float (*getDeadband)(void);
+} AppRateLimitConfig;
+
+static const AppRateLimitConfig kAppRateLimits[] = {
+    {kAppCharacteristic_ThermostatCurrentTemp,
+     mgos_sys_config_get_app_events_room_temp_interval_ms,
+     mgos_sys_config_get_app_events_room_temp_burst,
+     mgos_sys_config_get_app_events_room_temp_deadband},
+};
+
+typedef struct {
+  float tokens;
+  int64_t refillUs;
+  bool initialized;
+  bool held;  // A change is held back, heldValue.
+  float heldValue;
+} AppRateLimit;
+
+/**
+ * HVAC parameters that can be written by the controllers.
+ */
+typedef struct {
+  enum mgos_mel_ac_param_power power;
+  enum mgos_mel_ac_param_mode mode;
+  float setpoint;
+  enum mgos_mel_ac_param_fan fan;
+  enum mgos_mel_ac_param_vane_vert vane_vert;
+  enum mgos_mel_ac_param_vane_horiz vane_horiz;
+} AppParams;
+
+/**
+ * Last confirmed HVAC state as stored in the key-value store.
+ */
+typedef struct {
+  uint8_t version;
+  uint8_t power;
+  uint8_t mode;
+  uint8_t fan;
+  uint8_t vane_vert;
+  uint8_t vane_horiz;
+  uint8_t setpoint;   // Half degrees Celsius.
+  int16_t roomTemp;  // Tenths of a degree Celsius.
+} HVACStateRecord;
+
+#define kHVACStateRecord_Version 1
+
+typedef enum {
+  kAppParam_Power = 1 << 0,
+  kAppParam_Mode = 1 << 1,
+  kAppParam_Setpoint = 1 << 2,
+  kAppParam_Fan = 1 << 3,
+  kAppParam_VaneVert = 1 << 4,
+  kAppParam_VaneHoriz = 1 << 5,
+} AppParamFlags;
+
 /**
  * Global accessory configuration.
  */
@@ -37,6 +163,41 @@ typedef struct {
   struct {
     uint8_t ThermostatTemperatureDisplayUnits;
   } state;
+  AccessoryState snapshot;   // Values served to reads.
+  AccessoryState published;  // Values last raised to controllers.
+  bool publishedValid;
+  uint32_t dirty;  // Characteristics raised even if unchanged, bit per index.
+  mgos_timer_id rateLimitTimer;  // Events held back by the rate limiter.
+  AppRateLimit rateLimits[HAPArrayCount(kAppRateLimits)];
+  struct {
+    const HAPSessionRef *session;  // Controller that wrote the value.
+    float value;
+  } writers[kAppCharacteristic_Count];  // Writes not raised yet.
+  int numSessions;
+  HAPSessionRef **sessions;  // Connected sessions, numSessions entries.
+  int sessionsCapacity;
+  struct {
+    AppParams params;
+    uint8_t flags;  // AppParamFlags
+    mgos_timer_id timer;
+    int64_t firstUs;  // When the oldest staged parameter was written.
+  } staged;  // Written by controllers, not yet sent to the HVAC.
+  struct {
+    AppParams params;
+    uint8_t flags;  // AppParamFlags
+    uint8_t sent;   // Flags carried by the SET packet on the line.
+  } pending;  // Sent to the HVAC, not confirmed yet.
+  struct {
+    AppParams params;
+    uint8_t flags;  // AppParamFlags
+    mgos_timer_id timer;  // Drops the values after app.write_defer_ms.
+  } deferred;  // Written while the unit is off, sent with power on.
+  struct {
+    AppParams params;
+    float roomTemp;
+    bool stale;  // Loaded at boot, served until the first PARAMS_CHANGED.
+    bool roomTempStale;  // Served until the first ROOMTEMP_CHANGED.
+  } lastKnown;
   HAPAccessoryServerRef *server;
   HAPPlatformKeyValueStoreRef keyValueStore;
 } AccessoryConfiguration;
@@ -50,22 +211,12 @@ static AccessoryConfiguration accessoryConfiguration;
 static void LoadAccessoryState(void) {
   HAPPrecondition(accessoryConfiguration.keyValueStore);
 
-  HAPError err;
-
   // Load persistent state if available
-  bool found;
   size_t numBytes;
+  bool found = app_store_get(kAppKeyValueStoreKey_Configuration_State,
+                             &accessoryConfiguration.state,
+                             sizeof accessoryConfiguration.state, &numBytes);
 
-  err = HAPPlatformKeyValueStoreGet(
-      accessoryConfiguration.keyValueStore,
-      kAppKeyValueStoreDomain_Configuration,
-      kAppKeyValueStoreKey_Configuration_State, &accessoryConfiguration.state,
-      sizeof accessoryConfiguration.state, &numBytes, &found);
-
-  if (err) {
-    HAPAssert(err == kHAPError_Unknown);
-    HAPFatalError();
-  }
   if (!found || numBytes != sizeof accessoryConfiguration.state) {
     if (found) {
       HAPLogError(&kHAPLog_Default,
@@ -80,23 +231,413 @@ static void LoadAccessoryState(void) {
 }
 
 /**
- * Save the accessory state to persistent memory.
+ * Save the accessory state to persistent memory. The write is deferred by the
+ * app store, see app_store.h.
  */
 static void SaveAccessoryState(void) {
   HAPPrecondition(accessoryConfiguration.keyValueStore);
 
-  HAPError err;
-  err = HAPPlatformKeyValueStoreSet(accessoryConfiguration.keyValueStore,
-                                    kAppKeyValueStoreDomain_Configuration,
-                                    kAppKeyValueStoreKey_Configuration_State,
-                                    &accessoryConfiguration.state,
-                                    sizeof accessoryConfiguration.state);
-  if (err) {
-    HAPAssert(err == kHAPError_Unknown);
+  if (!app_store_set(kAppKeyValueStoreKey_Configuration_State,
+                     &accessoryConfiguration.state,
+                     sizeof accessoryConfiguration.state)) {
     HAPFatalError();
   }
 }
 
+/**
+ * Load the last confirmed HVAC state. It is served to controllers until the
+ * unit reports its parameters, so reads right after a reboot or OTA get the
+ * values the unit most likely still has instead of zeros.
+ */
+static void LoadHVACState(void) {
+  HAPPrecondition(accessoryConfiguration.keyValueStore);
+
+  AppParams *params = &accessoryConfiguration.lastKnown.params;
+  HVACStateRecord record;
+  size_t numBytes;
+
+  if (!app_store_get(kAppKeyValueStoreKey_Configuration_HVACState, &record,
+                     sizeof record, &numBytes) ||
+      numBytes != sizeof record ||
+      record.version != kHVACStateRecord_Version) {
+    return;
+  }
+  params->power = (enum mgos_mel_ac_param_power) record.power;
+  params->mode = (enum mgos_mel_ac_param_mode) record.mode;
+  params->setpoint = record.setpoint / 2.0f;
+  params->fan = (enum mgos_mel_ac_param_fan) record.fan;
+  params->vane_vert = (enum mgos_mel_ac_param_vane_vert) record.vane_vert;
+  params->vane_horiz = (enum mgos_mel_ac_param_vane_horiz) record.vane_horiz;
+  accessoryConfiguration.lastKnown.roomTemp = record.roomTemp / 10.0f;
+  accessoryConfiguration.lastKnown.stale = true;
+  accessoryConfiguration.lastKnown.roomTempStale = true;
+  APP_LOG(HANDLERS, LL_INFO,
+          ("%s: power %d, mode %d, setpoint %.1f", __func__, record.power,
+           record.mode, params->setpoint));
+}
+
+/**
+ * Save the HVAC state reported by the unit. The app store skips records that
+ * did not change and defers the flash write. Nothing is saved before the
+ * unit has reported its parameters, the library would only have defaults.
+ */
+static void SaveHVACState(void) {
+  if (!accessoryConfiguration.keyValueStore) return;
+  if (accessoryConfiguration.lastKnown.stale) return;
+
+  HVACStateRecord record;
+  float roomTemp = accessoryConfiguration.lastKnown.roomTempStale
+                       ? accessoryConfiguration.lastKnown.roomTemp
+                       : mgos_mel_ac_get_room_temperature();
+
+  // Zeroed first, the padding is compared by the app store.
+  HAPRawBufferZero(&record, sizeof record);
+  record.version = kHVACStateRecord_Version;
+  record.power = (uint8_t) mgos_mel_ac_get_power();
+  record.mode = (uint8_t) mgos_mel_ac_get_mode();
+  record.fan = (uint8_t) mgos_mel_ac_get_fan();
+  record.vane_vert = (uint8_t) mgos_mel_ac_get_vane_vert();
+  record.vane_horiz = (uint8_t) mgos_mel_ac_get_vane_horiz();
+  record.setpoint = (uint8_t) roundf(mgos_mel_ac_get_setpoint() * 2);
+  record.roomTemp = (int16_t) roundf(roomTemp * 10);
+  (void) app_store_set(kAppKeyValueStoreKey_Configuration_HVACState, &record,
+                       sizeof record);
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+
+/**
+ * Stage a parameter written by a controller. All parameters staged within
+ * app.write_window_ms (e.g. mode, temperature and fan speed set together by
+ * a scene) are committed to the HVAC together, in one SET transaction.
+ *
+ * Slider driven parameters (setpoint, fan speed) are debounced: every write
+ * restarts an app.write_debounce_ms hold-off, so a drag is sent once with
+ * its last value as soon as the finger stops, and at least every
+ * app.write_max_hold_ms while it keeps moving.
+ *
+ * With app.write_fast the other parameters skip the window and are committed
+ * on the next event loop turn: all characteristics of one HAP write request
+ * are handled in the same turn, so they still go out together. When the
+ * library sends them is up to its own sequencing at mel_ac.period_ms.
+ */
+static void CommitStagedParams(void *arg);
+
+static void StageParams(uint8_t flags) {
+  int64_t now = mgos_uptime_micros();
+  int delayMs = mgos_sys_config_get_app_write_fast()
+                    ? 0
+                    : mgos_sys_config_get_app_write_window_ms();
+
+  if (accessoryConfiguration.staged.flags == 0) {
+    accessoryConfiguration.staged.firstUs = now;
+  }
+  accessoryConfiguration.staged.flags |= flags;
+  if (flags & (kAppParam_Setpoint | kAppParam_Fan)) {
+    int debounceMs = mgos_sys_config_get_app_write_debounce_ms();
+    int heldMs = (int) ((now - accessoryConfiguration.staged.firstUs) / 1000);
+    int leftMs = mgos_sys_config_get_app_write_max_hold_ms() - heldMs;
+    if (debounceMs > delayMs) delayMs = debounceMs;
+    if (delayMs > leftMs) delayMs = leftMs > 0 ? leftMs : 0;
+  } else if (accessoryConfiguration.staged.timer != MGOS_INVALID_TIMER_ID) {
+    return;
+  }
+  if (accessoryConfiguration.staged.timer != MGOS_INVALID_TIMER_ID) {
+    mgos_clear_timer(accessoryConfiguration.staged.timer);
+  }
+  accessoryConfiguration.staged.timer =
+      mgos_set_timer(delayMs, 0, CommitStagedParams, NULL);
+}
+
+static void CommitStagedParams(void *arg) {
+  const AppParams *params = &accessoryConfiguration.staged.params;
+  uint8_t flags = accessoryConfiguration.staged.flags;
+
+  accessoryConfiguration.staged.timer = MGOS_INVALID_TIMER_ID;
+  accessoryConfiguration.staged.flags = 0;
+  if (flags == 0) return;
+
+  APP_LOG(HANDLERS, LL_INFO, ("%s: 0x%02x", __func__, flags));
+  accessoryConfiguration.pending.params = *params;
+  accessoryConfiguration.pending.flags |= flags;
+  // A newer value than the one on the line, the next SET confirms it.
+  accessoryConfiguration.pending.sent &= ~flags;
+  if (flags & kAppParam_Power) mgos_mel_ac_set_power(params->power);
+  if (flags & kAppParam_Mode) mgos_mel_ac_set_mode(params->mode);
+  if (flags & kAppParam_Setpoint) mgos_mel_ac_set_setpoint(params->setpoint);
+  if (flags & kAppParam_Fan) mgos_mel_ac_set_fan(params->fan);
+  if (flags & kAppParam_VaneVert) mgos_mel_ac_set_vane_vert(params->vane_vert);
+  if (flags & kAppParam_VaneHoriz)
+    mgos_mel_ac_set_vane_horiz(params->vane_horiz);
+  mel_stats_write();
+  (void) arg;
+}
+
+/**
+ * Shadow state: parameters staged, deferred until power on or sent to the
+ * HVAC but not confirmed yet take precedence over the values reported by the
+ * unit, so controllers see a write immediately instead of the old value until
+ * the next sync.
+ */
+static const AppParams *_Nullable GetShadowParams(uint8_t flag) {
+  if (accessoryConfiguration.staged.flags & flag) {
+    return &accessoryConfiguration.staged.params;
+  }
+  if (accessoryConfiguration.deferred.flags & flag) {
+    return &accessoryConfiguration.deferred.params;
+  }
+  if (accessoryConfiguration.pending.flags & flag) {
+    return &accessoryConfiguration.pending.params;
+  }
+  if (accessoryConfiguration.lastKnown.stale) {
+    return &accessoryConfiguration.lastKnown.params;
+  }
+  return NULL;
+}
+
+static enum mgos_mel_ac_param_power GetTargetPower(void) {
+  const AppParams *shadow = GetShadowParams(kAppParam_Power);
+  return shadow ? shadow->power : mgos_mel_ac_get_power();
+}
+
+static enum mgos_mel_ac_param_mode GetTargetMode(void) {
+  const AppParams *shadow = GetShadowParams(kAppParam_Mode);
+  return shadow ? shadow->mode : mgos_mel_ac_get_mode();
+}
+
+static float GetTargetSetpoint(void) {
+  const AppParams *shadow = GetShadowParams(kAppParam_Setpoint);
+  return shadow ? shadow->setpoint : mgos_mel_ac_get_setpoint();
+}
+
+static enum mgos_mel_ac_param_fan GetTargetFan(void) {
+  const AppParams *shadow = GetShadowParams(kAppParam_Fan);
+  return shadow ? shadow->fan : mgos_mel_ac_get_fan();
+}
+
+static enum mgos_mel_ac_param_vane_vert GetTargetVaneVert(void) {
+  const AppParams *shadow = GetShadowParams(kAppParam_VaneVert);
+  return shadow ? shadow->vane_vert : mgos_mel_ac_get_vane_vert();
+}
+
+static enum mgos_mel_ac_param_vane_horiz GetTargetVaneHoriz(void) {
+  const AppParams *shadow = GetShadowParams(kAppParam_VaneHoriz);
+  return shadow ? shadow->vane_horiz : mgos_mel_ac_get_vane_horiz();
+}
+
+/**
+ * Stage a parameter unless it equals the current or pending value: repeated
+ * writes from automations would otherwise cost a full UART transaction.
+ * Until the unit reports its parameters the values loaded at boot may be
+ * outdated, so nothing is skipped.
+ */
+static bool SkipWrite(bool same) {
+  if (accessoryConfiguration.lastKnown.stale) return false;
+  return same;
+}
+
+/**
+ * Count a HomeKit write as skipped if none of the parameters it sets was
+ * staged or deferred. Handlers that also stage a field they keep as is
+ * (power with a mode, mode with power off) count the write once.
+ */
+static void CountSkippedWrite(bool staged) {
+  if (!staged) mel_stats_write_skipped();
+}
+
+static void NotifyChangedCharacteristics(void);
+
+static bool IsDeferred(uint8_t flag) {
+  return (accessoryConfiguration.deferred.flags & flag) != 0;
+}
+
+static void ClearDeferredParams(void) {
+  if (accessoryConfiguration.deferred.timer != MGOS_INVALID_TIMER_ID) {
+    mgos_clear_timer(accessoryConfiguration.deferred.timer);
+    accessoryConfiguration.deferred.timer = MGOS_INVALID_TIMER_ID;
+  }
+  accessoryConfiguration.deferred.flags = 0;
+}
+
+static void ExpireDeferredParams(void *arg) {
+  accessoryConfiguration.deferred.timer = MGOS_INVALID_TIMER_ID;
+  APP_LOG(HANDLERS, LL_INFO,
+          ("%s: 0x%02x", __func__, accessoryConfiguration.deferred.flags));
+  ClearDeferredParams();
+  NotifyChangedCharacteristics();
+  (void) arg;
+}
+
+/**
+ * Setpoint, fan and vanes written while the unit is off are deferred: they
+ * are shown to controllers right away and sent in the same SET transaction
+ * as the next power on from a controller. They are dropped, and controllers
+ * get the unit's values back, after app.write_defer_ms without one, or when
+ * the unit is switched on by other means.
+ */
+static bool DeferParam(uint8_t flag) {
+  int timeoutMs = mgos_sys_config_get_app_write_defer_ms();
+
+  if (GetTargetPower() == MGOS_MEL_AC_PARAM_POWER_ON) return false;
+  accessoryConfiguration.deferred.flags |= flag;
+  if (accessoryConfiguration.deferred.timer != MGOS_INVALID_TIMER_ID) {
+    mgos_clear_timer(accessoryConfiguration.deferred.timer);
+  }
+  accessoryConfiguration.deferred.timer =
+      mgos_set_timer(timeoutMs, 0, ExpireDeferredParams, NULL);
+  return true;
+}
+
+/**
+ * Move the deferred parameters to the staged ones, returns their flags.
+ */
+static uint8_t TakeDeferredParams(void) {
+  const AppParams *deferred = &accessoryConfiguration.deferred.params;
+  AppParams *staged = &accessoryConfiguration.staged.params;
+  uint8_t flags = accessoryConfiguration.deferred.flags;
+
+  if (flags & kAppParam_Setpoint) staged->setpoint = deferred->setpoint;
+  if (flags & kAppParam_Fan) staged->fan = deferred->fan;
+  if (flags & kAppParam_VaneVert) staged->vane_vert = deferred->vane_vert;
+  if (flags & kAppParam_VaneHoriz) staged->vane_horiz = deferred->vane_horiz;
+  ClearDeferredParams();
+  return flags;
+}
+
+/**
+ * The unit was switched on by other means (IR remote, schedule): whoever did
+ * it chose the settings, the deferred values are dropped. A power on sent by
+ * this app has already taken them.
+ */
+static void DropDeferredParams(void) {
+  if (accessoryConfiguration.deferred.flags == 0) return;
+  if (GetTargetPower() != MGOS_MEL_AC_PARAM_POWER_ON) return;
+  APP_LOG(HANDLERS, LL_INFO,
+          ("%s: 0x%02x", __func__, accessoryConfiguration.deferred.flags));
+  ClearDeferredParams();
+}
+
+static bool StagePower(enum mgos_mel_ac_param_power power) {
+  if (SkipWrite(power == GetTargetPower())) return false;
+  accessoryConfiguration.staged.params.power = power;
+  StageParams(kAppParam_Power);
+  if (power == MGOS_MEL_AC_PARAM_POWER_ON) {
+    accessoryConfiguration.staged.flags |= TakeDeferredParams();
+  }
+  return true;
+}
+
+static bool StageMode(enum mgos_mel_ac_param_mode mode) {
+  if (SkipWrite(mode == GetTargetMode())) return false;
+  accessoryConfiguration.staged.params.mode = mode;
+  StageParams(kAppParam_Mode);
+  return true;
+}
+
+// Setpoints are quantized to the characteristic step the unit supports.
+static bool StageSetpoint(float setpoint) {
+  float step = ThermostatTargetTempCharacteristic.constraints.stepValue;
+  if (step > 0) setpoint = roundf(setpoint / step) * step;
+  if (SkipWrite(setpoint == GetTargetSetpoint())) return false;
+  if (DeferParam(kAppParam_Setpoint)) {
+    accessoryConfiguration.deferred.params.setpoint = setpoint;
+    return true;
+  }
+  accessoryConfiguration.staged.params.setpoint = setpoint;
+  StageParams(kAppParam_Setpoint);
+  return true;
+}
+
+static bool StageFan(enum mgos_mel_ac_param_fan fan) {
+  if (SkipWrite(fan == GetTargetFan())) return false;
+  if (DeferParam(kAppParam_Fan)) {
+    accessoryConfiguration.deferred.params.fan = fan;
+    return true;
+  }
+  accessoryConfiguration.staged.params.fan = fan;
+  StageParams(kAppParam_Fan);
+  return true;
+}
+
+static bool StageVaneVert(enum mgos_mel_ac_param_vane_vert vane_vert) {
+  if (SkipWrite(vane_vert == GetTargetVaneVert())) return false;
+  if (DeferParam(kAppParam_VaneVert)) {
+    accessoryConfiguration.deferred.params.vane_vert = vane_vert;
+    return true;
+  }
+  accessoryConfiguration.staged.params.vane_vert = vane_vert;
+  StageParams(kAppParam_VaneVert);
+  return true;
+}
+
+static bool StageVaneHoriz(enum mgos_mel_ac_param_vane_horiz vane_horiz) {
+  if (SkipWrite(vane_horiz == GetTargetVaneHoriz())) return false;
+  if (DeferParam(kAppParam_VaneHoriz)) {
+    accessoryConfiguration.deferred.params.vane_horiz = vane_horiz;
+    return true;
+  }
+  accessoryConfiguration.staged.params.vane_horiz = vane_horiz;
+  StageParams(kAppParam_VaneHoriz);
+  return true;
+}
+
+/**
+ * SET packet layout: type at byte 1, then data from byte 5. Settings SETs
+ * have 0x01 in data byte 0, data byte 1 flags power, mode, setpoint, fan
+ * and vertical vane, data byte 2 the horizontal vane.
+ */
+#define kMelPacketType_Set 0x41
+#define kMelSetType_Offset 5
+#define kMelSetType_Settings 0x01
+#define kMelSetFlags1_Offset 6
+#define kMelSetFlags2_Offset 7
+
+/**
+ * Remember which pending parameters the SET packet being sent carries, so
+ * its confirmation does not clear writes committed after it went out.
+ * The library reports the packet only as a hex dump, it has no call for
+ * the parameters of the SET in flight.
+ */
+static void NoteSetPacket(const char *hex) {
+  uint8_t packet[kMelSetFlags2_Offset + 1];
+  uint8_t flags1, flags2;
+  uint8_t sent = 0;
+
+  if (trace_decode(hex, packet, sizeof packet) < (int) sizeof packet) return;
+  if (packet[1] != kMelPacketType_Set) return;
+  if (packet[kMelSetType_Offset] != kMelSetType_Settings) return;
+  flags1 = packet[kMelSetFlags1_Offset];
+  flags2 = packet[kMelSetFlags2_Offset];
+  if (flags1 & 0x01) sent |= kAppParam_Power;
+  if (flags1 & 0x02) sent |= kAppParam_Mode;
+  if (flags1 & 0x04) sent |= kAppParam_Setpoint;
+  if (flags1 & 0x08) sent |= kAppParam_Fan;
+  if (flags1 & 0x10) sent |= kAppParam_VaneVert;
+  if (flags2 & 0x01) sent |= kAppParam_VaneHoriz;
+  accessoryConfiguration.pending.sent =
+      sent & accessoryConfiguration.pending.flags;
+}
+
+/**
+ * Drop the pending parameters the HVAC confirmed or rejected: those carried
+ * by the last SET packet. If the packet was not seen, all of them.
+ */
+static void ClearPendingParams(void) {
+  if (accessoryConfiguration.pending.sent == 0) {
+    accessoryConfiguration.pending.flags = 0;
+  }
+  accessoryConfiguration.pending.flags &= ~accessoryConfiguration.pending.sent;
+  accessoryConfiguration.pending.sent = 0;
+}
+
+/**
+ * The link is down, nothing pending will be confirmed.
+ */
+static void DropPendingParams(void) {
+  accessoryConfiguration.pending.flags = 0;
+  accessoryConfiguration.pending.sent = 0;
+}
+
 //----------------------------------------------------------------------------------------------------------------------
 
 /**
@@ -125,12 +666,66 @@ static HAPAccessory accessory = {
 
 void AccessoryNotification(const HAPService *service,
                            const HAPCharacteristic *characteristic) {
-  HAPLogInfo(&kHAPLog_Default, "Accessory Notification");
+  APP_LOG(NOTIFY, LL_INFO, ("Accessory Notification"));
 
+#if APP_BENCH
+  bench_event_raised();
+#endif
   HAPAccessoryServerRaiseEvent(accessoryConfiguration.server, characteristic,
                                service, &accessory);
 }
 
+/**
+ * Raise an event to every connected session except the one given.
+ */
+static void AccessoryNotificationExcept(const HAPService *service,
+                                        const HAPCharacteristic *characteristic,
+                                        const HAPSessionRef *except) {
+  APP_LOG(NOTIFY, LL_INFO, ("Accessory Notification (skipping writer)"));
+
+#if APP_BENCH
+  bench_event_raised();
+#endif
+  for (int i = 0; i < accessoryConfiguration.numSessions; i++) {
+    const HAPSessionRef *session = accessoryConfiguration.sessions[i];
+    if (session == except) continue;
+    HAPAccessoryServerRaiseEventOnSession(accessoryConfiguration.server,
+                                          characteristic, service, &accessory,
+                                          session);
+  }
+}
+
+/**
+ * Remember which controller wrote a characteristic, so the resulting event
+ * is not echoed back to it. Other characteristics changed by the write are
+ * still raised to every session.
+ */
+static void NoteWrite(AppCharacteristic characteristic,
+                      const HAPSessionRef *session, float value) {
+  accessoryConfiguration.writers[characteristic].session = session;
+  accessoryConfiguration.writers[characteristic].value = value;
+}
+
+/**
+ * Raise a characteristic on the next pass even if its value did not change,
+ * to correct the optimistic value of a controller whose write was ignored.
+ */
+static void MarkDirty(AppCharacteristic characteristic) {
+  accessoryConfiguration.dirty |= 1u << characteristic;
+}
+
+static void GetAccessoryState(AccessoryState *state);
+
+/**
+ * Characteristic value from the state snapshot.
+ *
+ * The snapshot is rebuilt once per MEL-AC event or write, so reads are plain
+ * loads and all characteristics of one GET come from the same HVAC state.
+ */
+static float GetSnapshotValue(AppCharacteristic characteristic) {
+  return accessoryConfiguration.snapshot.values[characteristic];
+}
+
 static void identify_timer_cb(void *arg) {
   mgos_gpio_blink(mgos_sys_config_get_pins_led(), 0, 0);
   mgos_gpio_write(mgos_sys_config_get_pins_led(), LED_OFF);
@@ -142,7 +737,7 @@ HAPError IdentifyAccessory(HAPAccessoryServerRef *server HAP_UNUSED,
                            const HAPAccessoryIdentifyRequest *request
                                HAP_UNUSED,
                            void *_Nullable context HAP_UNUSED) {
-  HAPLogInfo(&kHAPLog_Default, "%s", __func__);
+  APP_LOG(HANDLERS, LL_INFO, ("%s", __func__));
   mgos_gpio_blink(mgos_sys_config_get_pins_led(), 50, 100);
   mgos_set_timer(1000, 0, identify_timer_cb, NULL);
   return kHAPError_None;
@@ -152,23 +747,43 @@ float c2f(float c) {
   return c * 9 / 5 + 32;
 }
 
+static float clampFloat(const HAPFloatCharacteristic *characteristic,
+                        float value) {
+  value = value > characteristic->constraints.maximumValue
+              ? characteristic->constraints.maximumValue
+              : value;
+  value = value < characteristic->constraints.minimumValue
+              ? characteristic->constraints.minimumValue
+              : value;
+  return value;
+}
+
+static float GetRoomTemperature(void) {
+  return accessoryConfiguration.lastKnown.roomTempStale
+             ? accessoryConfiguration.lastKnown.roomTemp
+             : mgos_mel_ac_get_room_temperature();
+}
+
+static float handleThermostatCurrentTemp() {
+  float value =
+      accessoryConfiguration.state.ThermostatTemperatureDisplayUnits ==
+              kHAPCharacteristicValue_TemperatureDisplayUnits_Celsius
+          ? GetRoomTemperature()
+          : c2f(GetRoomTemperature());
+  return clampFloat(&ThermostatCurrentTempCharacteristic, value);
+}
+
+static float handleThermostatTargetTemp() {
+  return clampFloat(&ThermostatTargetTempCharacteristic, GetTargetSetpoint());
+}
+
 HAP_RESULT_USE_CHECK
 HAPError HandleThermostatCurrentTempRead(
     HAPAccessoryServerRef *server HAP_UNUSED,
     const HAPFloatCharacteristicReadRequest *request HAP_UNUSED, float *value,
     void *_Nullable context HAP_UNUSED) {
-  *value = accessoryConfiguration.state.ThermostatTemperatureDisplayUnits ==
-                   kHAPCharacteristicValue_TemperatureDisplayUnits_Celsius
-               ? mgos_mel_ac_get_room_temperature()
-               : c2f(mgos_mel_ac_get_room_temperature());
-
-  *value = *value > request->characteristic->constraints.maximumValue
-               ? request->characteristic->constraints.maximumValue
-               : *value;
-  *value = *value < request->characteristic->constraints.minimumValue
-               ? request->characteristic->constraints.minimumValue
-               : *value;
-  HAPLogInfo(&kHAPLog_Default, "%s: %.1f", __func__, *value);
+  *value = GetSnapshotValue(kAppCharacteristic_ThermostatCurrentTemp);
+  APP_LOG(HANDLERS, LL_INFO, ("%s: %.1f", __func__, *value));
 
   return kHAPError_None;
 }
@@ -178,14 +793,8 @@ HAPError HandleThermostatTargetTempRead(
     HAPAccessoryServerRef *server HAP_UNUSED,
     const HAPFloatCharacteristicReadRequest *request HAP_UNUSED, float *value,
     void *_Nullable context HAP_UNUSED) {
-  *value = mgos_mel_ac_get_setpoint();
-  *value = *value > request->characteristic->constraints.maximumValue
-               ? request->characteristic->constraints.maximumValue
-               : *value;
-  *value = *value < request->characteristic->constraints.minimumValue
-               ? request->characteristic->constraints.minimumValue
-               : *value;
-  HAPLogInfo(&kHAPLog_Default, "%s: %.1f", __func__, *value);
+  *value = GetSnapshotValue(kAppCharacteristic_ThermostatTargetTemp);
+  APP_LOG(HANDLERS, LL_INFO, ("%s: %.1f", __func__, *value));
 
   return kHAPError_None;
 }
@@ -195,25 +804,25 @@ HAPError HandleThermostatTargetTempWrite(
     HAPAccessoryServerRef *server,
     const HAPFloatCharacteristicWriteRequest *request, float value,
     void *_Nullable context HAP_UNUSED) {
-  HAPLogInfo(&kHAPLog_Default, "%s: %.1f", __func__, value);
+  APP_LOG(HANDLERS, LL_INFO, ("%s: %.1f", __func__, value));
 
   if (!mgos_mel_ac_get_connected()) return kHAPError_InvalidState;
 
-  if (mgos_mel_ac_get_power() == MGOS_MEL_AC_PARAM_POWER_ON)
-    mgos_mel_ac_set_setpoint(value);
+  NoteWrite(kAppCharacteristic_ThermostatTargetTemp, request->session, value);
 
-  AccessoryNotification(request->service, request->characteristic);
+  CountSkippedWrite(StageSetpoint(value));
+  NotifyChangedCharacteristics();
 
   return kHAPError_None;
 }
 
 static uint8_t handleThermostatCurrentState() {
-  if (mgos_mel_ac_get_power() == MGOS_MEL_AC_PARAM_POWER_OFF)
+  if (GetTargetPower() == MGOS_MEL_AC_PARAM_POWER_OFF)
     return kHAPCharacteristicValue_CurrentHeatingCoolingState_Off;
 
-  float currentTemp = mgos_mel_ac_get_room_temperature();
-  float targetTemp = mgos_mel_ac_get_setpoint();
-  switch (mgos_mel_ac_get_mode()) {
+  float currentTemp = GetRoomTemperature();
+  float targetTemp = GetTargetSetpoint();
+  switch (GetTargetMode()) {
     case MGOS_MEL_AC_PARAM_MODE_COOL:
       return kHAPCharacteristicValue_CurrentHeatingCoolingState_Cool;
     case MGOS_MEL_AC_PARAM_MODE_HEAT:
@@ -234,10 +843,10 @@ static uint8_t handleThermostatCurrentState() {
 }
 
 static uint8_t handleThermostatTargetState() {
-  if (mgos_mel_ac_get_power() == MGOS_MEL_AC_PARAM_POWER_OFF)
+  if (GetTargetPower() == MGOS_MEL_AC_PARAM_POWER_OFF)
     return kHAPCharacteristicValue_TargetHeatingCoolingState_Off;
 
-  switch (mgos_mel_ac_get_mode()) {
+  switch (GetTargetMode()) {
     case MGOS_MEL_AC_PARAM_MODE_AUTO:
       return kHAPCharacteristicValue_TargetHeatingCoolingState_Auto;
     case MGOS_MEL_AC_PARAM_MODE_COOL:
@@ -256,8 +865,8 @@ HAPError HandleThermostatCurrentHCstateRead(
     HAPAccessoryServerRef *server HAP_UNUSED,
     const HAPUInt8CharacteristicReadRequest *request HAP_UNUSED, uint8_t *value,
     void *_Nullable context HAP_UNUSED) {
-  *value = handleThermostatCurrentState();
-  HAPLogInfo(&kHAPLog_Default, "%s: %d", __func__, *value);
+  *value = GetSnapshotValue(kAppCharacteristic_ThermostatCurrentHCstate);
+  APP_LOG(HANDLERS, LL_INFO, ("%s: %d", __func__, *value));
 
   return kHAPError_None;
 }
@@ -267,15 +876,18 @@ HAPError HandleThermostatTargetHCstateRead(
     HAPAccessoryServerRef *server HAP_UNUSED,
     const HAPUInt8CharacteristicReadRequest *request HAP_UNUSED, uint8_t *value,
     void *_Nullable context HAP_UNUSED) {
-  *value = handleThermostatTargetState();
-  HAPLogInfo(&kHAPLog_Default, "%s: %d", __func__, *value);
+  *value = GetSnapshotValue(kAppCharacteristic_ThermostatTargetHCstate);
+  APP_LOG(HANDLERS, LL_INFO, ("%s: %d", __func__, *value));
 
   return kHAPError_None;
 }
 
+// While the unit is off a deferred fan speed is shown, not the stopped fan.
 static float handleFan() {
-  if (mgos_mel_ac_get_power() == MGOS_MEL_AC_PARAM_POWER_OFF) return 0;
-  switch (mgos_mel_ac_get_fan()) {
+  if (GetTargetPower() == MGOS_MEL_AC_PARAM_POWER_OFF &&
+      !IsDeferred(kAppParam_Fan))
+    return 0;
+  switch (GetTargetFan()) {
     case MGOS_MEL_AC_PARAM_FAN_AUTO:
       return 100;
     case MGOS_MEL_AC_PARAM_FAN_QUIET:
@@ -293,58 +905,22 @@ static float handleFan() {
   }
 }
 
-static void handleFanService() {
-  //   AccessoryNotification(&FanService, &FanStatusActiveCharacteristic);
-  AccessoryNotification(&FanService, &FanActiveCharacteristic);
-  AccessoryNotification(&FanService, &FanCurrentSateCharacteristic);
-  AccessoryNotification(&FanService, &FanTargetSateCharacteristic);
-  AccessoryNotification(&FanService, &FanRotationSpeedCharacteristic);
-}
-
-static void handleModeFanService() {
-  //   AccessoryNotification(&ModeFanService,
-  //   &ModeFanStatusActiveCharacteristic);
-  AccessoryNotification(&ModeFanService, &ModeFanOnCharacteristic);
-}
-
-static void handleModeDryService() {
-  //   AccessoryNotification(&ModeDryService,
-  //   &ModeDryStatusActiveCharacteristic);
-  AccessoryNotification(&ModeDryService, &ModeDryOnCharacteristic);
-}
-
-static void handleThermostatService() {
-  //   AccessoryNotification(&ThermostatService,
-  //                         &ThermostatStatusActiveCharacteristic);
-  AccessoryNotification(&ThermostatService,
-                        &ThermostatCurrentHCstateCharacteristic);
-  AccessoryNotification(&ThermostatService,
-                        &ThermostatTargetHCstateCharacteristic);
-  AccessoryNotification(&ThermostatService,
-                        &ThermostatTargetTempCharacteristic);
-}
-
-static void handleThermostatServiceTargetState() {
-  //   AccessoryNotification(&ThermostatService,
-  //                         &ThermostatStatusActiveCharacteristic);
-  AccessoryNotification(&ThermostatService,
-                        &ThermostatCurrentHCstateCharacteristic);
-  AccessoryNotification(&ThermostatService,
-                        &ThermostatTargetTempCharacteristic);
-}
-
 HAP_RESULT_USE_CHECK
 HAPError HandleThermostatTargetHCstateWrite(
     HAPAccessoryServerRef *server,
     const HAPUInt8CharacteristicWriteRequest *request, uint8_t value,
     void *_Nullable context HAP_UNUSED) {
-  HAPLogInfo(&kHAPLog_Default, "%s: %d", __func__, value);
+  APP_LOG(HANDLERS, LL_INFO, ("%s: %d", __func__, value));
 
   if (!mgos_mel_ac_get_connected()) return kHAPError_InvalidState;
 
-  enum mgos_mel_ac_param_mode mode = mgos_mel_ac_get_mode();
+  NoteWrite(kAppCharacteristic_ThermostatTargetHCstate, request->session,
+            value);
 
-  mgos_mel_ac_set_power(
+  enum mgos_mel_ac_param_mode mode = GetTargetMode();
+  bool staged;
+
+  staged = StagePower(
       value == kHAPCharacteristicValue_TargetHeatingCoolingState_Off
           ? ((mode == MGOS_MEL_AC_PARAM_MODE_DRY) ||
              (mode == MGOS_MEL_AC_PARAM_MODE_FAN))
@@ -363,13 +939,11 @@ HAPError HandleThermostatTargetHCstateWrite(
       mode = MGOS_MEL_AC_PARAM_MODE_HEAT;
       break;
   }
-  mgos_mel_ac_set_mode(mode);
+  // Off re-stages the current mode, only a write changing neither counts.
+  staged |= StageMode(mode);
+  CountSkippedWrite(staged);
 
-  handleFanService();
-  handleThermostatServiceTargetState();  // do not update HCtarget state,
-                                         // because we just set it from HAP
-  handleModeFanService();
-  handleModeDryService();
+  NotifyChangedCharacteristics();
 
   return kHAPError_None;
 }
@@ -379,8 +953,9 @@ HAPError HandleThermostatTemperatureDisplayUnitsRead(
     HAPAccessoryServerRef *server HAP_UNUSED,
     const HAPUInt8CharacteristicReadRequest *request HAP_UNUSED, uint8_t *value,
     void *_Nullable context HAP_UNUSED) {
-  *value = accessoryConfiguration.state.ThermostatTemperatureDisplayUnits;
-  HAPLogInfo(&kHAPLog_Default, "%s: %d", __func__, *value);
+  *value =
+      GetSnapshotValue(kAppCharacteristic_ThermostatTemperatureDisplayUnits);
+  APP_LOG(HANDLERS, LL_INFO, ("%s: %d", __func__, *value));
 
   return kHAPError_None;
 }
@@ -390,18 +965,19 @@ HAPError HandleThermostatTemperatureDisplayUnitsWrite(
     HAPAccessoryServerRef *server,
     const HAPUInt8CharacteristicWriteRequest *request, uint8_t value,
     void *_Nullable context HAP_UNUSED) {
-  HAPLogInfo(&kHAPLog_Default, "%s: %d", __func__, value);
+  APP_LOG(HANDLERS, LL_INFO, ("%s: %d", __func__, value));
 
   if (!mgos_mel_ac_get_connected()) return kHAPError_InvalidState;
 
+  NoteWrite(kAppCharacteristic_ThermostatTemperatureDisplayUnits,
+            request->session, value);
+
   if (accessoryConfiguration.state.ThermostatTemperatureDisplayUnits != value) {
     accessoryConfiguration.state.ThermostatTemperatureDisplayUnits = value;
 
     SaveAccessoryState();
 
-    AccessoryNotification(request->service, request->characteristic);
-    AccessoryNotification(request->service,
-                          &ThermostatCurrentTempCharacteristic);
+    NotifyChangedCharacteristics();
   }
 
   return kHAPError_None;
@@ -412,8 +988,8 @@ HAPError HandleStatusActiveRead(
     HAPAccessoryServerRef *server HAP_UNUSED,
     const HAPBoolCharacteristicReadRequest *request HAP_UNUSED, bool *value,
     void *_Nullable context HAP_UNUSED) {
-  *value = mgos_mel_ac_get_connected();
-  HAPLogInfo(&kHAPLog_Default, "%s: %s", __func__, *value ? "true" : "false");
+  *value = GetSnapshotValue(kAppCharacteristic_ThermostatStatusActive);
+  APP_LOG(HANDLERS, LL_INFO, ("%s: %s", __func__, *value ? "true" : "false"));
 
   return kHAPError_None;
 }
@@ -425,15 +1001,33 @@ void AppCreate(HAPAccessoryServerRef *server,
   HAPPrecondition(server);
   HAPPrecondition(keyValueStore);
 
-  HAPLogInfo(&kHAPLog_Default, "%s", __func__);
+  APP_LOG(HANDLERS, LL_INFO, ("%s", __func__));
 
   HAPRawBufferZero(&accessoryConfiguration, sizeof accessoryConfiguration);
   accessoryConfiguration.server = server;
   accessoryConfiguration.keyValueStore = keyValueStore;
   LoadAccessoryState();
+  LoadHVACState();
+  GetAccessoryState(&accessoryConfiguration.snapshot);
 }
 
 void AppRelease(void) {
+  if (accessoryConfiguration.staged.timer != MGOS_INVALID_TIMER_ID) {
+    mgos_clear_timer(accessoryConfiguration.staged.timer);
+    accessoryConfiguration.staged.timer = MGOS_INVALID_TIMER_ID;
+  }
+  if (accessoryConfiguration.rateLimitTimer != MGOS_INVALID_TIMER_ID) {
+    mgos_clear_timer(accessoryConfiguration.rateLimitTimer);
+    accessoryConfiguration.rateLimitTimer = MGOS_INVALID_TIMER_ID;
+  }
+  ClearDeferredParams();
+  // AppCreate zeroes the configuration, the session table would leak.
+  free(accessoryConfiguration.sessions);
+  accessoryConfiguration.sessions = NULL;
+  accessoryConfiguration.numSessions = 0;
+  accessoryConfiguration.sessionsCapacity = 0;
+  HAPRawBufferZero(accessoryConfiguration.writers,
+                   sizeof accessoryConfiguration.writers);
 }
 
 void AppAccessoryServerStart(void) {
@@ -445,7 +1039,7 @@ void AppAccessoryServerStart(void) {
 // VaneVert
 
 static int32_t handleVaneVert() {
-  switch (mgos_mel_ac_get_vane_vert()) {
+  switch (GetTargetVaneVert()) {
     case MGOS_MEL_AC_PARAM_VANE_VERT_AUTO:
     case MGOS_MEL_AC_PARAM_VANE_VERT_LEFTRIGHT:
       return 0;
@@ -464,15 +1058,16 @@ static int32_t handleVaneVert() {
   }
 }
 
-static void handleVaneVertService() {
-  //   AccessoryNotification(&VaneVertService,
-  //   &VaneVertStatusActiveCharacteristic);
-  AccessoryNotification(&VaneVertService, &VaneVertSwingModeCharacteristic);
-  AccessoryNotification(&VaneVertService, &VaneVertCurrentSateCharacteristic);
-  AccessoryNotification(&VaneVertService,
-                        &VaneVertCurrentTiltAngleCharacteristic);
-  AccessoryNotification(&VaneVertService,
-                        &VaneVertTargetTiltAngleCharacteristic);
+static uint8_t handleVaneVertCurrentState() {
+  return GetTargetVaneVert() == MGOS_MEL_AC_PARAM_VANE_VERT_SWING
+             ? kHAPCharacteristicValue_CurrentSlatState_Swinging
+             : kHAPCharacteristicValue_CurrentSlatState_Fixed;
+}
+
+static uint8_t handleVaneVertSwingMode() {
+  return GetTargetVaneVert() == MGOS_MEL_AC_PARAM_VANE_VERT_SWING
+             ? kHAPCharacteristicValue_SwingMode_Enabled
+             : kHAPCharacteristicValue_SwingMode_Disabled;
 }
 
 HAP_RESULT_USE_CHECK
@@ -480,10 +1075,8 @@ HAPError HandleVaneVertCurrentStateRead(
     HAPAccessoryServerRef *server HAP_UNUSED,
     const HAPUInt8CharacteristicReadRequest *request HAP_UNUSED, uint8_t *value,
     void *_Nullable context HAP_UNUSED) {
-  *value = mgos_mel_ac_get_vane_vert() == MGOS_MEL_AC_PARAM_VANE_VERT_SWING
-               ? kHAPCharacteristicValue_CurrentSlatState_Swinging
-               : kHAPCharacteristicValue_CurrentSlatState_Fixed;
-  HAPLogInfo(&kHAPLog_Default, "%s: %d", __func__, *value);
+  *value = GetSnapshotValue(kAppCharacteristic_VaneVertCurrentState);
+  APP_LOG(HANDLERS, LL_INFO, ("%s: %d", __func__, *value));
 
   return kHAPError_None;
 }
@@ -494,7 +1087,7 @@ HAPError HandleVaneVertTypeRead(
     const HAPUInt8CharacteristicReadRequest *request HAP_UNUSED, uint8_t *value,
     void *_Nullable context HAP_UNUSED) {
   *value = kHAPCharacteristicValue_SlatType_Vertical;
-  HAPLogInfo(&kHAPLog_Default, "%s: %d", __func__, *value);
+  APP_LOG(HANDLERS, LL_INFO, ("%s: %d", __func__, *value));
 
   return kHAPError_None;
 }
@@ -504,8 +1097,8 @@ HAPError HandleVaneVertCurrentTiltAngleRead(
     HAPAccessoryServerRef *server HAP_UNUSED,
     const HAPIntCharacteristicReadRequest *request HAP_UNUSED, int32_t *value,
     void *_Nullable context HAP_UNUSED) {
-  *value = handleVaneVert();
-  HAPLogInfo(&kHAPLog_Default, "%s: %ld", __func__, (long int) *value);
+  *value = GetSnapshotValue(kAppCharacteristic_VaneVertCurrentTiltAngle);
+  APP_LOG(HANDLERS, LL_INFO, ("%s: %ld", __func__, (long int) *value));
 
   return kHAPError_None;
 }
@@ -515,8 +1108,8 @@ HAPError HandleVaneVertTargetTiltAngleRead(
     HAPAccessoryServerRef *server HAP_UNUSED,
     const HAPIntCharacteristicReadRequest *request HAP_UNUSED, int32_t *value,
     void *_Nullable context HAP_UNUSED) {
-  *value = handleVaneVert();
-  HAPLogInfo(&kHAPLog_Default, "%s: %ld", __func__, (long int) *value);
+  *value = GetSnapshotValue(kAppCharacteristic_VaneVertTargetTiltAngle);
+  APP_LOG(HANDLERS, LL_INFO, ("%s: %ld", __func__, (long int) *value));
 
   return kHAPError_None;
 }
@@ -526,36 +1119,37 @@ HAPError HandleVaneVertTargetTiltAngleWrite(
     HAPAccessoryServerRef *server,
     const HAPIntCharacteristicWriteRequest *request, int32_t value,
     void *_Nullable context HAP_UNUSED) {
-  HAPLogInfo(&kHAPLog_Default, "%s: %ld", __func__, (long int) value);
+  APP_LOG(HANDLERS, LL_INFO, ("%s: %ld", __func__, (long int) value));
 
   if (!mgos_mel_ac_get_connected()) return kHAPError_InvalidState;
 
-  if (mgos_mel_ac_get_power() == MGOS_MEL_AC_PARAM_POWER_ON) {
-    enum mgos_mel_ac_param_vane_vert vane_vert;
-    switch (value) {
-      case -90:
-        vane_vert = MGOS_MEL_AC_PARAM_VANE_VERT_LEFTEST;
-        break;
-      case -45:
-        vane_vert = MGOS_MEL_AC_PARAM_VANE_VERT_LEFT;
-        break;
-      case 0:
-        vane_vert = MGOS_MEL_AC_PARAM_VANE_VERT_CENTER;
-        break;
-      case 45:
-        vane_vert = MGOS_MEL_AC_PARAM_VANE_VERT_RIGHT;
-        break;
-      case 90:
-        vane_vert = MGOS_MEL_AC_PARAM_VANE_VERT_RIGHTEST;
-        break;
-      default:
-        vane_vert = MGOS_MEL_AC_PARAM_VANE_VERT_CENTER;
-        break;
-    }
-    mgos_mel_ac_set_vane_vert(vane_vert);
+  NoteWrite(kAppCharacteristic_VaneVertTargetTiltAngle, request->session,
+            value);
+
+  enum mgos_mel_ac_param_vane_vert vane_vert;
+  switch (value) {
+    case -90:
+      vane_vert = MGOS_MEL_AC_PARAM_VANE_VERT_LEFTEST;
+      break;
+    case -45:
+      vane_vert = MGOS_MEL_AC_PARAM_VANE_VERT_LEFT;
+      break;
+    case 0:
+      vane_vert = MGOS_MEL_AC_PARAM_VANE_VERT_CENTER;
+      break;
+    case 45:
+      vane_vert = MGOS_MEL_AC_PARAM_VANE_VERT_RIGHT;
+      break;
+    case 90:
+      vane_vert = MGOS_MEL_AC_PARAM_VANE_VERT_RIGHTEST;
+      break;
+    default:
+      vane_vert = MGOS_MEL_AC_PARAM_VANE_VERT_CENTER;
+      break;
   }
+  CountSkippedWrite(StageVaneVert(vane_vert));
 
-  handleVaneVertService();
+  NotifyChangedCharacteristics();
 
   return kHAPError_None;
 }
@@ -565,10 +1159,8 @@ HAPError HandleVaneVertSwingModeRead(
     HAPAccessoryServerRef *server HAP_UNUSED,
     const HAPUInt8CharacteristicReadRequest *request HAP_UNUSED, uint8_t *value,
     void *_Nullable context HAP_UNUSED) {
-  *value = mgos_mel_ac_get_vane_vert() == MGOS_MEL_AC_PARAM_VANE_VERT_SWING
-               ? kHAPCharacteristicValue_SwingMode_Enabled
-               : kHAPCharacteristicValue_SwingMode_Disabled;
-  HAPLogInfo(&kHAPLog_Default, "%s: %d", __func__, *value);
+  *value = GetSnapshotValue(kAppCharacteristic_VaneVertSwingMode);
+  APP_LOG(HANDLERS, LL_INFO, ("%s: %d", __func__, *value));
 
   return kHAPError_None;
 }
@@ -578,16 +1170,18 @@ HAPError HandleVaneVertSwingModeWrite(
     HAPAccessoryServerRef *server,
     const HAPUInt8CharacteristicWriteRequest *request, uint8_t value,
     void *_Nullable context HAP_UNUSED) {
-  HAPLogInfo(&kHAPLog_Default, "%s: %d", __func__, value);
+  APP_LOG(HANDLERS, LL_INFO, ("%s: %d", __func__, value));
 
   if (!mgos_mel_ac_get_connected()) return kHAPError_InvalidState;
 
-  if (mgos_mel_ac_get_power() == MGOS_MEL_AC_PARAM_POWER_ON)
-    mgos_mel_ac_set_vane_vert(value == kHAPCharacteristicValue_SwingMode_Enabled
-                                  ? MGOS_MEL_AC_PARAM_VANE_VERT_SWING
-                                  : MGOS_MEL_AC_PARAM_VANE_VERT_AUTO);
+  NoteWrite(kAppCharacteristic_VaneVertSwingMode, request->session, value);
+
+  CountSkippedWrite(
+      StageVaneVert(value == kHAPCharacteristicValue_SwingMode_Enabled
+                        ? MGOS_MEL_AC_PARAM_VANE_VERT_SWING
+                        : MGOS_MEL_AC_PARAM_VANE_VERT_AUTO));
 
-  handleVaneVertService();
+  NotifyChangedCharacteristics();
 
   return kHAPError_None;
 }
@@ -595,7 +1189,7 @@ HAPError HandleVaneVertSwingModeWrite(
 // VaneHoriz
 
 static int32_t handleVaneHoriz() {
-  switch (mgos_mel_ac_get_vane_horiz()) {
+  switch (GetTargetVaneHoriz()) {
     case MGOS_MEL_AC_PARAM_VANE_HORIZ_AUTO:
       return 0;
     case MGOS_MEL_AC_PARAM_VANE_HORIZ_1:
@@ -613,15 +1207,16 @@ static int32_t handleVaneHoriz() {
   }
 }
 
-static void handleVaneHorizService() {
-  //   AccessoryNotification(&VaneHorizService,
-  //                         &VaneHorizStatusActiveCharacteristic);
-  AccessoryNotification(&VaneHorizService, &VaneHorizSwingModeCharacteristic);
-  AccessoryNotification(&VaneHorizService, &VaneHorizCurrentSateCharacteristic);
-  AccessoryNotification(&VaneHorizService,
-                        &VaneHorizCurrentTiltAngleCharacteristic);
-  AccessoryNotification(&VaneHorizService,
-                        &VaneHorizTargetTiltAngleCharacteristic);
+static uint8_t handleVaneHorizCurrentState() {
+  return GetTargetVaneHoriz() == MGOS_MEL_AC_PARAM_VANE_HORIZ_SWING
+             ? kHAPCharacteristicValue_CurrentSlatState_Swinging
+             : kHAPCharacteristicValue_CurrentSlatState_Fixed;
+}
+
+static uint8_t handleVaneHorizSwingMode() {
+  return GetTargetVaneHoriz() == MGOS_MEL_AC_PARAM_VANE_HORIZ_SWING
+             ? kHAPCharacteristicValue_SwingMode_Enabled
+             : kHAPCharacteristicValue_SwingMode_Disabled;
 }
 
 HAP_RESULT_USE_CHECK
@@ -629,10 +1224,8 @@ HAPError HandleVaneHorizCurrentStateRead(
     HAPAccessoryServerRef *server HAP_UNUSED,
     const HAPUInt8CharacteristicReadRequest *request HAP_UNUSED, uint8_t *value,
     void *_Nullable context HAP_UNUSED) {
-  *value = mgos_mel_ac_get_vane_horiz() == MGOS_MEL_AC_PARAM_VANE_HORIZ_SWING
-               ? kHAPCharacteristicValue_CurrentSlatState_Swinging
-               : kHAPCharacteristicValue_CurrentSlatState_Fixed;
-  HAPLogInfo(&kHAPLog_Default, "%s: %d", __func__, *value);
+  *value = GetSnapshotValue(kAppCharacteristic_VaneHorizCurrentState);
+  APP_LOG(HANDLERS, LL_INFO, ("%s: %d", __func__, *value));
 
   return kHAPError_None;
 }
@@ -643,7 +1236,7 @@ HAPError HandleVaneHorizTypeRead(
     const HAPUInt8CharacteristicReadRequest *request HAP_UNUSED, uint8_t *value,
     void *_Nullable context HAP_UNUSED) {
   *value = kHAPCharacteristicValue_SlatType_Horizontal;
-  HAPLogInfo(&kHAPLog_Default, "%s: %d", __func__, *value);
+  APP_LOG(HANDLERS, LL_INFO, ("%s: %d", __func__, *value));
 
   return kHAPError_None;
 }
@@ -653,8 +1246,8 @@ HAPError HandleVaneHorizCurrentTiltAngleRead(
     HAPAccessoryServerRef *server HAP_UNUSED,
     const HAPIntCharacteristicReadRequest *request HAP_UNUSED, int32_t *value,
     void *_Nullable context HAP_UNUSED) {
-  *value = handleVaneHoriz();
-  HAPLogInfo(&kHAPLog_Default, "%s: %ld", __func__, (long int) *value);
+  *value = GetSnapshotValue(kAppCharacteristic_VaneHorizCurrentTiltAngle);
+  APP_LOG(HANDLERS, LL_INFO, ("%s: %ld", __func__, (long int) *value));
 
   return kHAPError_None;
 }
@@ -664,8 +1257,8 @@ HAPError HandleVaneHorizTargetTiltAngleRead(
     HAPAccessoryServerRef *server HAP_UNUSED,
     const HAPIntCharacteristicReadRequest *request HAP_UNUSED, int32_t *value,
     void *_Nullable context HAP_UNUSED) {
-  *value = handleVaneHoriz();
-  HAPLogInfo(&kHAPLog_Default, "%s: %ld", __func__, (long int) *value);
+  *value = GetSnapshotValue(kAppCharacteristic_VaneHorizTargetTiltAngle);
+  APP_LOG(HANDLERS, LL_INFO, ("%s: %ld", __func__, (long int) *value));
 
   return kHAPError_None;
 }
@@ -675,37 +1268,38 @@ HAPError HandleVaneHorizTargetTiltAngleWrite(
     HAPAccessoryServerRef *server,
     const HAPIntCharacteristicWriteRequest *request, int32_t value,
     void *_Nullable context HAP_UNUSED) {
-  HAPLogInfo(&kHAPLog_Default, "%s: %ld", __func__, (long int) value);
+  APP_LOG(HANDLERS, LL_INFO, ("%s: %ld", __func__, (long int) value));
 
   if (!mgos_mel_ac_get_connected()) return kHAPError_InvalidState;
 
-  if (mgos_mel_ac_get_power() == MGOS_MEL_AC_PARAM_POWER_ON) {
-    enum mgos_mel_ac_param_vane_horiz vane_horiz;
-
-    switch (value) {
-      case -90:
-        vane_horiz = MGOS_MEL_AC_PARAM_VANE_HORIZ_1;
-        break;
-      case -45:
-        vane_horiz = MGOS_MEL_AC_PARAM_VANE_HORIZ_2;
-        break;
-      case 0:
-        vane_horiz = MGOS_MEL_AC_PARAM_VANE_HORIZ_3;
-        break;
-      case 45:
-        vane_horiz = MGOS_MEL_AC_PARAM_VANE_HORIZ_4;
-        break;
-      case 90:
-        vane_horiz = MGOS_MEL_AC_PARAM_VANE_HORIZ_5;
-        break;
-      default:
-        vane_horiz = MGOS_MEL_AC_PARAM_VANE_HORIZ_AUTO;
-        break;
-    }
-    mgos_mel_ac_set_vane_horiz(vane_horiz);
+  NoteWrite(kAppCharacteristic_VaneHorizTargetTiltAngle, request->session,
+            value);
+
+  enum mgos_mel_ac_param_vane_horiz vane_horiz;
+
+  switch (value) {
+    case -90:
+      vane_horiz = MGOS_MEL_AC_PARAM_VANE_HORIZ_1;
+      break;
+    case -45:
+      vane_horiz = MGOS_MEL_AC_PARAM_VANE_HORIZ_2;
+      break;
+    case 0:
+      vane_horiz = MGOS_MEL_AC_PARAM_VANE_HORIZ_3;
+      break;
+    case 45:
+      vane_horiz = MGOS_MEL_AC_PARAM_VANE_HORIZ_4;
+      break;
+    case 90:
+      vane_horiz = MGOS_MEL_AC_PARAM_VANE_HORIZ_5;
+      break;
+    default:
+      vane_horiz = MGOS_MEL_AC_PARAM_VANE_HORIZ_AUTO;
+      break;
   }
+  CountSkippedWrite(StageVaneHoriz(vane_horiz));
 
-  handleVaneHorizService();
+  NotifyChangedCharacteristics();
 
   return kHAPError_None;
 }
@@ -715,10 +1309,8 @@ HAPError HandleVaneHorizSwingModeRead(
     HAPAccessoryServerRef *server HAP_UNUSED,
     const HAPUInt8CharacteristicReadRequest *request HAP_UNUSED, uint8_t *value,
     void *_Nullable context HAP_UNUSED) {
-  *value = mgos_mel_ac_get_vane_horiz() == MGOS_MEL_AC_PARAM_VANE_HORIZ_SWING
-               ? kHAPCharacteristicValue_SwingMode_Enabled
-               : kHAPCharacteristicValue_SwingMode_Disabled;
-  HAPLogInfo(&kHAPLog_Default, "%s: %d", __func__, *value);
+  *value = GetSnapshotValue(kAppCharacteristic_VaneHorizSwingMode);
+  APP_LOG(HANDLERS, LL_INFO, ("%s: %d", __func__, *value));
 
   return kHAPError_None;
 }
@@ -728,32 +1320,52 @@ HAPError HandleVaneHorizSwingModeWrite(
     HAPAccessoryServerRef *server,
     const HAPUInt8CharacteristicWriteRequest *request, uint8_t value,
     void *_Nullable context HAP_UNUSED) {
-  HAPLogInfo(&kHAPLog_Default, "%s: %d", __func__, value);
+  APP_LOG(HANDLERS, LL_INFO, ("%s: %d", __func__, value));
 
   if (!mgos_mel_ac_get_connected()) return kHAPError_InvalidState;
 
-  if (mgos_mel_ac_get_power() == MGOS_MEL_AC_PARAM_POWER_ON)
-    mgos_mel_ac_set_vane_horiz(value ==
-                                       kHAPCharacteristicValue_SwingMode_Enabled
-                                   ? MGOS_MEL_AC_PARAM_VANE_HORIZ_SWING
-                                   : MGOS_MEL_AC_PARAM_VANE_HORIZ_AUTO);
+  NoteWrite(kAppCharacteristic_VaneHorizSwingMode, request->session, value);
 
-  handleVaneHorizService();
+  CountSkippedWrite(
+      StageVaneHoriz(value == kHAPCharacteristicValue_SwingMode_Enabled
+                         ? MGOS_MEL_AC_PARAM_VANE_HORIZ_SWING
+                         : MGOS_MEL_AC_PARAM_VANE_HORIZ_AUTO));
+
+  NotifyChangedCharacteristics();
 
   return kHAPError_None;
 }
 
 // Fan
 
+static uint8_t handleFanActive() {
+  return GetTargetPower() == MGOS_MEL_AC_PARAM_POWER_ON
+             ? kHAPCharacteristicValue_Active_Active
+             : kHAPCharacteristicValue_Active_Inactive;
+}
+
+static uint8_t handleFanCurrentState() {
+  return GetTargetPower() == MGOS_MEL_AC_PARAM_POWER_ON
+             ? kHAPCharacteristicValue_CurrentFanState_BlowingAir
+             : kHAPCharacteristicValue_CurrentFanState_Inactive;
+}
+
+static uint8_t handleFanTargetState() {
+  return GetTargetPower() == MGOS_MEL_AC_PARAM_POWER_OFF &&
+                 !IsDeferred(kAppParam_Fan)
+             ? kHAPCharacteristicValue_TargetFanState_Manual
+         : GetTargetFan() == MGOS_MEL_AC_PARAM_FAN_AUTO
+             ? kHAPCharacteristicValue_TargetFanState_Auto
+             : kHAPCharacteristicValue_TargetFanState_Manual;
+}
+
 HAP_RESULT_USE_CHECK
 HAPError HandleFanActiveRead(
     HAPAccessoryServerRef *server HAP_UNUSED,
     const HAPUInt8CharacteristicReadRequest *request HAP_UNUSED, uint8_t *value,
     void *_Nullable context HAP_UNUSED) {
-  *value = mgos_mel_ac_get_power() == MGOS_MEL_AC_PARAM_POWER_ON
-               ? kHAPCharacteristicValue_Active_Active
-               : kHAPCharacteristicValue_Active_Inactive;
-  HAPLogInfo(&kHAPLog_Default, "%s: %d", __func__, *value);
+  *value = GetSnapshotValue(kAppCharacteristic_FanActive);
+  APP_LOG(HANDLERS, LL_INFO, ("%s: %d", __func__, *value));
 
   return kHAPError_None;
 }
@@ -763,11 +1375,13 @@ HAPError HandleFanActiveWrite(HAPAccessoryServerRef *server,
                               const HAPUInt8CharacteristicWriteRequest *request,
                               uint8_t value,
                               void *_Nullable context HAP_UNUSED) {
-  HAPLogInfo(&kHAPLog_Default, "%s: %d", __func__, value);
+  APP_LOG(HANDLERS, LL_INFO, ("%s: %d", __func__, value));
 
   if (!mgos_mel_ac_get_connected()) return kHAPError_InvalidState;
 
-  handleFanService();
+  // Fan power follows the thermostat: raise the unchanged value back.
+  MarkDirty(kAppCharacteristic_FanActive);
+  NotifyChangedCharacteristics();
   return kHAPError_None;
 }
 
@@ -776,10 +1390,8 @@ HAPError HandleFanCurrentStateRead(
     HAPAccessoryServerRef *server HAP_UNUSED,
     const HAPUInt8CharacteristicReadRequest *request HAP_UNUSED, uint8_t *value,
     void *_Nullable context HAP_UNUSED) {
-  *value = mgos_mel_ac_get_power() == MGOS_MEL_AC_PARAM_POWER_ON
-               ? kHAPCharacteristicValue_CurrentFanState_BlowingAir
-               : kHAPCharacteristicValue_CurrentFanState_Inactive;
-  HAPLogInfo(&kHAPLog_Default, "%s: %d", __func__, *value);
+  *value = GetSnapshotValue(kAppCharacteristic_FanCurrentState);
+  APP_LOG(HANDLERS, LL_INFO, ("%s: %d", __func__, *value));
 
   return kHAPError_None;
 }
@@ -789,12 +1401,8 @@ HAPError HandleFanTargetStateRead(
     HAPAccessoryServerRef *server HAP_UNUSED,
     const HAPUInt8CharacteristicReadRequest *request HAP_UNUSED, uint8_t *value,
     void *_Nullable context HAP_UNUSED) {
-  *value = mgos_mel_ac_get_power() == MGOS_MEL_AC_PARAM_POWER_OFF
-               ? kHAPCharacteristicValue_TargetFanState_Manual
-           : mgos_mel_ac_get_fan() == MGOS_MEL_AC_PARAM_FAN_AUTO
-               ? kHAPCharacteristicValue_TargetFanState_Auto
-               : kHAPCharacteristicValue_TargetFanState_Manual;
-  HAPLogInfo(&kHAPLog_Default, "%s: %d", __func__, *value);
+  *value = GetSnapshotValue(kAppCharacteristic_FanTargetState);
+  APP_LOG(HANDLERS, LL_INFO, ("%s: %d", __func__, *value));
 
   return kHAPError_None;
 }
@@ -804,16 +1412,18 @@ HAPError HandleFanTargetStateWrite(
     HAPAccessoryServerRef *server,
     const HAPUInt8CharacteristicWriteRequest *request, uint8_t value,
     void *_Nullable context HAP_UNUSED) {
-  HAPLogInfo(&kHAPLog_Default, "%s: %d", __func__, value);
+  APP_LOG(HANDLERS, LL_INFO, ("%s: %d", __func__, value));
 
   if (!mgos_mel_ac_get_connected()) return kHAPError_InvalidState;
 
-  if (mgos_mel_ac_get_power() == MGOS_MEL_AC_PARAM_POWER_ON)
-    mgos_mel_ac_set_fan(value == kHAPCharacteristicValue_TargetFanState_Auto
-                            ? MGOS_MEL_AC_PARAM_FAN_AUTO
-                            : MGOS_MEL_AC_PARAM_FAN_MED);
+  NoteWrite(kAppCharacteristic_FanTargetState, request->session, value);
 
-  handleFanService();
+  CountSkippedWrite(
+      StageFan(value == kHAPCharacteristicValue_TargetFanState_Auto
+                   ? MGOS_MEL_AC_PARAM_FAN_AUTO
+                   : MGOS_MEL_AC_PARAM_FAN_MED));
+
+  NotifyChangedCharacteristics();
 
   return kHAPError_None;
 }
@@ -823,8 +1433,8 @@ HAPError HandleFanRotationSpeedRead(
     HAPAccessoryServerRef *server HAP_UNUSED,
     const HAPFloatCharacteristicReadRequest *request HAP_UNUSED, float *value,
     void *_Nullable context HAP_UNUSED) {
-  *value = handleFan();
-  HAPLogInfo(&kHAPLog_Default, "%s: %f", __func__, *value);
+  *value = GetSnapshotValue(kAppCharacteristic_FanRotationSpeed);
+  APP_LOG(HANDLERS, LL_INFO, ("%s: %f", __func__, *value));
 
   return kHAPError_None;
 }
@@ -834,48 +1444,52 @@ HAPError HandleFanRotationSpeedWrite(
     HAPAccessoryServerRef *server,
     const HAPFloatCharacteristicWriteRequest *request, float value,
     void *_Nullable context HAP_UNUSED) {
-  HAPLogInfo(&kHAPLog_Default, "%s: %f", __func__, value);
+  APP_LOG(HANDLERS, LL_INFO, ("%s: %f", __func__, value));
 
   if (!mgos_mel_ac_get_connected()) return kHAPError_InvalidState;
 
-  if (mgos_mel_ac_get_power() == MGOS_MEL_AC_PARAM_POWER_ON) {
-    enum mgos_mel_ac_param_fan fan = mgos_mel_ac_get_fan();
-    switch ((uint8_t) value) {
-      case 0:
-        fan = MGOS_MEL_AC_PARAM_FAN_QUIET;
-        break;
-      case 25:
-        fan = MGOS_MEL_AC_PARAM_FAN_LOW;
-        break;
-      case 50:
-        fan = MGOS_MEL_AC_PARAM_FAN_MED;
-        break;
-      case 75:
-        fan = MGOS_MEL_AC_PARAM_FAN_HIGH;
-        break;
-      case 100:
-        fan = MGOS_MEL_AC_PARAM_FAN_TURBO;
-        break;
-      default:
-        break;
-    }
-    mgos_mel_ac_set_fan(fan);
+  NoteWrite(kAppCharacteristic_FanRotationSpeed, request->session, value);
+
+  enum mgos_mel_ac_param_fan fan = GetTargetFan();
+  switch ((uint8_t) value) {
+    case 0:
+      fan = MGOS_MEL_AC_PARAM_FAN_QUIET;
+      break;
+    case 25:
+      fan = MGOS_MEL_AC_PARAM_FAN_LOW;
+      break;
+    case 50:
+      fan = MGOS_MEL_AC_PARAM_FAN_MED;
+      break;
+    case 75:
+      fan = MGOS_MEL_AC_PARAM_FAN_HIGH;
+      break;
+    case 100:
+      fan = MGOS_MEL_AC_PARAM_FAN_TURBO;
+      break;
+    default:
+      break;
   }
-  handleFanService();
+  CountSkippedWrite(StageFan(fan));
+  NotifyChangedCharacteristics();
 
   return kHAPError_None;
 }
 
 // ModeFan
 
+static bool handleModeFanOn() {
+  return (GetTargetPower() == MGOS_MEL_AC_PARAM_POWER_ON) &&
+         (GetTargetMode() == MGOS_MEL_AC_PARAM_MODE_FAN);
+}
+
 HAP_RESULT_USE_CHECK
 HAPError HandleModeFanOnRead(HAPAccessoryServerRef *server HAP_UNUSED,
                              const HAPBoolCharacteristicReadRequest *request
                                  HAP_UNUSED,
                              bool *value, void *_Nullable context HAP_UNUSED) {
-  *value = (mgos_mel_ac_get_power() == MGOS_MEL_AC_PARAM_POWER_ON) &&
-           (mgos_mel_ac_get_mode() == MGOS_MEL_AC_PARAM_MODE_FAN);
-  HAPLogInfo(&kHAPLog_Default, "%s: %s", __func__, *value ? "true" : "false");
+  *value = GetSnapshotValue(kAppCharacteristic_ModeFanOn);
+  APP_LOG(HANDLERS, LL_INFO, ("%s: %s", __func__, *value ? "true" : "false"));
 
   return kHAPError_None;
 }
@@ -884,34 +1498,37 @@ HAP_RESULT_USE_CHECK
 HAPError HandleModeFanOnWrite(HAPAccessoryServerRef *server,
                               const HAPBoolCharacteristicWriteRequest *request,
                               bool value, void *_Nullable context HAP_UNUSED) {
-  HAPLogInfo(&kHAPLog_Default, "%s: %s", __func__, value ? "true" : "false");
+  APP_LOG(HANDLERS, LL_INFO, ("%s: %s", __func__, value ? "true" : "false"));
 
   if (!mgos_mel_ac_get_connected()) return kHAPError_InvalidState;
 
-  mgos_mel_ac_set_power(value ? MGOS_MEL_AC_PARAM_POWER_ON
-                              : MGOS_MEL_AC_PARAM_POWER_OFF);
+  NoteWrite(kAppCharacteristic_ModeFanOn, request->session, value);
 
-  mgos_mel_ac_set_mode(value ? MGOS_MEL_AC_PARAM_MODE_FAN
-                             : MGOS_MEL_AC_PARAM_MODE_AUTO);
+  bool staged = StagePower(value ? MGOS_MEL_AC_PARAM_POWER_ON
+                                 : MGOS_MEL_AC_PARAM_POWER_OFF);
+  staged |= StageMode(value ? MGOS_MEL_AC_PARAM_MODE_FAN
+                            : MGOS_MEL_AC_PARAM_MODE_AUTO);
+  CountSkippedWrite(staged);
 
-  handleThermostatService();
-  handleFanService();
-  handleModeFanService();
-  handleModeDryService();
+  NotifyChangedCharacteristics();
 
   return kHAPError_None;
 }
 
 // ModeDry
 
+static bool handleModeDryOn() {
+  return (GetTargetPower() == MGOS_MEL_AC_PARAM_POWER_ON) &&
+         (GetTargetMode() == MGOS_MEL_AC_PARAM_MODE_DRY);
+}
+
 HAP_RESULT_USE_CHECK
 HAPError HandleModeDryOnRead(HAPAccessoryServerRef *server HAP_UNUSED,
                              const HAPBoolCharacteristicReadRequest *request
                                  HAP_UNUSED,
                              bool *value, void *_Nullable context HAP_UNUSED) {
-  *value = (mgos_mel_ac_get_power() == MGOS_MEL_AC_PARAM_POWER_ON) &&
-           (mgos_mel_ac_get_mode() == MGOS_MEL_AC_PARAM_MODE_DRY);
-  HAPLogInfo(&kHAPLog_Default, "%s: %s", __func__, *value ? "true" : "false");
+  *value = GetSnapshotValue(kAppCharacteristic_ModeDryOn);
+  APP_LOG(HANDLERS, LL_INFO, ("%s: %s", __func__, *value ? "true" : "false"));
 
   return kHAPError_None;
 }
@@ -920,20 +1537,19 @@ HAP_RESULT_USE_CHECK
 HAPError HandleModeDryOnWrite(HAPAccessoryServerRef *server,
                               const HAPBoolCharacteristicWriteRequest *request,
                               bool value, void *_Nullable context HAP_UNUSED) {
-  HAPLogInfo(&kHAPLog_Default, "%s: %s", __func__, value ? "true" : "false");
+  APP_LOG(HANDLERS, LL_INFO, ("%s: %s", __func__, value ? "true" : "false"));
 
   if (!mgos_mel_ac_get_connected()) return kHAPError_InvalidState;
 
-  mgos_mel_ac_set_power(value ? MGOS_MEL_AC_PARAM_POWER_ON
-                              : MGOS_MEL_AC_PARAM_POWER_OFF);
+  NoteWrite(kAppCharacteristic_ModeDryOn, request->session, value);
 
-  mgos_mel_ac_set_mode(value ? MGOS_MEL_AC_PARAM_MODE_DRY
-                             : MGOS_MEL_AC_PARAM_MODE_AUTO);
+  bool staged = StagePower(value ? MGOS_MEL_AC_PARAM_POWER_ON
+                                 : MGOS_MEL_AC_PARAM_POWER_OFF);
+  staged |= StageMode(value ? MGOS_MEL_AC_PARAM_MODE_DRY
+                            : MGOS_MEL_AC_PARAM_MODE_AUTO);
+  CountSkippedWrite(staged);
 
-  handleThermostatService();
-  handleFanService();
-  handleModeFanService();
-  handleModeDryService();
+  NotifyChangedCharacteristics();
 
   return kHAPError_None;
 }
@@ -964,10 +1580,58 @@ void AccessoryServerHandleUpdatedState(HAPAccessoryServerRef *server,
   HAPFatalError();
 }
 
+void AccessoryServerHandleSessionAccept(HAPAccessoryServerRef *server,
+                                        HAPSessionRef *session,
+                                        void *_Nullable context) {
+  HAPPrecondition(server);
+  HAPPrecondition(session);
+
+  if (accessoryConfiguration.numSessions ==
+      accessoryConfiguration.sessionsCapacity) {
+    int capacity = accessoryConfiguration.sessionsCapacity * 2;
+    HAPSessionRef **sessions;
+    if (capacity == 0) capacity = 8;
+    sessions = realloc(accessoryConfiguration.sessions,
+                       capacity * sizeof(*sessions));
+    HAPAssert(sessions != NULL);
+    accessoryConfiguration.sessions = sessions;
+    accessoryConfiguration.sessionsCapacity = capacity;
+  }
+  accessoryConfiguration.sessions[accessoryConfiguration.numSessions++] =
+      session;
+  heap_mon_sessions(accessoryConfiguration.numSessions);
+  (void) context;
+}
+
+void AccessoryServerHandleSessionInvalidate(HAPAccessoryServerRef *server,
+                                            HAPSessionRef *session,
+                                            void *_Nullable context) {
+  HAPPrecondition(server);
+  HAPPrecondition(session);
+
+  for (int i = 0; i < accessoryConfiguration.numSessions; i++) {
+    if (accessoryConfiguration.sessions[i] != session) continue;
+    accessoryConfiguration.sessions[i] =
+        accessoryConfiguration.sessions[--accessoryConfiguration.numSessions];
+    break;
+  }
+  for (size_t i = 0; i < kAppCharacteristic_Count; i++) {
+    if (accessoryConfiguration.writers[i].session == session) {
+      accessoryConfiguration.writers[i].session = NULL;
+    }
+  }
+  heap_mon_sessions(accessoryConfiguration.numSessions);
+  (void) context;
+}
+
 HAPAccessory *AppGetAccessoryInfo() {
   return &accessory;
 }
 
+bool AppHasStagedParams(void) {
+  return accessoryConfiguration.staged.flags != 0;
+}
+
 void AppInitialize(
     HAPAccessoryServerOptions *hapAccessoryServerOptions HAP_UNUSED,
     HAPPlatform *hapPlatform HAP_UNUSED,
@@ -987,15 +1651,193 @@ void AppDeinitialize() {
   /*no-op*/
 }
 
-static void handleStatusActive() {
-  AccessoryNotification(&ThermostatService,
-                        &ThermostatStatusActiveCharacteristic);
-  AccessoryNotification(&FanService, &FanStatusActiveCharacteristic);
-  AccessoryNotification(&VaneVertService, &VaneVertStatusActiveCharacteristic);
-  AccessoryNotification(&VaneHorizService,
-                        &VaneHorizStatusActiveCharacteristic);
-  AccessoryNotification(&ModeFanService, &ModeFanStatusActiveCharacteristic);
-  AccessoryNotification(&ModeDryService, &ModeDryStatusActiveCharacteristic);
+//----------------------------------------------------------------------------------------------------------------------
+
+static const struct {
+  const HAPService *service;
+  const HAPCharacteristic *characteristic;
+} kAppCharacteristics[kAppCharacteristic_Count] = {
+    [kAppCharacteristic_ThermostatCurrentHCstate] =
+        {&ThermostatService, &ThermostatCurrentHCstateCharacteristic},
+    [kAppCharacteristic_ThermostatTargetHCstate] =
+        {&ThermostatService, &ThermostatTargetHCstateCharacteristic},
+    [kAppCharacteristic_ThermostatCurrentTemp] =
+        {&ThermostatService, &ThermostatCurrentTempCharacteristic},
+    [kAppCharacteristic_ThermostatTargetTemp] =
+        {&ThermostatService, &ThermostatTargetTempCharacteristic},
+    [kAppCharacteristic_ThermostatTemperatureDisplayUnits] =
+        {&ThermostatService, &ThermostatTemperatureDisplayUnitsCharacteristic},
+    [kAppCharacteristic_ThermostatStatusActive] =
+        {&ThermostatService, &ThermostatStatusActiveCharacteristic},
+    [kAppCharacteristic_FanActive] = {&FanService, &FanActiveCharacteristic},
+    [kAppCharacteristic_FanCurrentState] = {&FanService,
+                                            &FanCurrentSateCharacteristic},
+    [kAppCharacteristic_FanTargetState] = {&FanService,
+                                           &FanTargetSateCharacteristic},
+    [kAppCharacteristic_FanRotationSpeed] = {&FanService,
+                                             &FanRotationSpeedCharacteristic},
+    [kAppCharacteristic_FanStatusActive] = {&FanService,
+                                            &FanStatusActiveCharacteristic},
+    [kAppCharacteristic_VaneVertCurrentState] =
+        {&VaneVertService, &VaneVertCurrentSateCharacteristic},
+    [kAppCharacteristic_VaneVertCurrentTiltAngle] =
+        {&VaneVertService, &VaneVertCurrentTiltAngleCharacteristic},
+    [kAppCharacteristic_VaneVertTargetTiltAngle] =
+        {&VaneVertService, &VaneVertTargetTiltAngleCharacteristic},
+    [kAppCharacteristic_VaneVertSwingMode] =
+        {&VaneVertService, &VaneVertSwingModeCharacteristic},
+    [kAppCharacteristic_VaneVertStatusActive] =
+        {&VaneVertService, &VaneVertStatusActiveCharacteristic},
+    [kAppCharacteristic_VaneHorizCurrentState] =
+        {&VaneHorizService, &VaneHorizCurrentSateCharacteristic},
+    [kAppCharacteristic_VaneHorizCurrentTiltAngle] =
+        {&VaneHorizService, &VaneHorizCurrentTiltAngleCharacteristic},
+    [kAppCharacteristic_VaneHorizTargetTiltAngle] =
+        {&VaneHorizService, &VaneHorizTargetTiltAngleCharacteristic},
+    [kAppCharacteristic_VaneHorizSwingMode] =
+        {&VaneHorizService, &VaneHorizSwingModeCharacteristic},
+    [kAppCharacteristic_VaneHorizStatusActive] =
+        {&VaneHorizService, &VaneHorizStatusActiveCharacteristic},
+    [kAppCharacteristic_ModeFanOn] = {&ModeFanService,
+                                      &ModeFanOnCharacteristic},
+    [kAppCharacteristic_ModeFanStatusActive] =
+        {&ModeFanService, &ModeFanStatusActiveCharacteristic},
+    [kAppCharacteristic_ModeDryOn] = {&ModeDryService,
+                                      &ModeDryOnCharacteristic},
+    [kAppCharacteristic_ModeDryStatusActive] =
+        {&ModeDryService, &ModeDryStatusActiveCharacteristic},
+};
+
+/**
+ * Compute the value of every notifying characteristic from the HVAC state.
+ */
+static void GetAccessoryState(AccessoryState *state) {
+  float *v = state->values;
+  float active = mgos_mel_ac_get_connected();
+
+  v[kAppCharacteristic_ThermostatCurrentHCstate] =
+      handleThermostatCurrentState();
+  v[kAppCharacteristic_ThermostatTargetHCstate] = handleThermostatTargetState();
+  v[kAppCharacteristic_ThermostatCurrentTemp] = handleThermostatCurrentTemp();
+  v[kAppCharacteristic_ThermostatTargetTemp] = handleThermostatTargetTemp();
+  v[kAppCharacteristic_ThermostatTemperatureDisplayUnits] =
+      accessoryConfiguration.state.ThermostatTemperatureDisplayUnits;
+  v[kAppCharacteristic_FanActive] = handleFanActive();
+  v[kAppCharacteristic_FanCurrentState] = handleFanCurrentState();
+  v[kAppCharacteristic_FanTargetState] = handleFanTargetState();
+  v[kAppCharacteristic_FanRotationSpeed] = handleFan();
+  v[kAppCharacteristic_VaneVertCurrentState] = handleVaneVertCurrentState();
+  v[kAppCharacteristic_VaneVertCurrentTiltAngle] = handleVaneVert();
+  v[kAppCharacteristic_VaneVertTargetTiltAngle] = handleVaneVert();
+  v[kAppCharacteristic_VaneVertSwingMode] = handleVaneVertSwingMode();
+  v[kAppCharacteristic_VaneHorizCurrentState] = handleVaneHorizCurrentState();
+  v[kAppCharacteristic_VaneHorizCurrentTiltAngle] = handleVaneHoriz();
+  v[kAppCharacteristic_VaneHorizTargetTiltAngle] = handleVaneHoriz();
+  v[kAppCharacteristic_VaneHorizSwingMode] = handleVaneHorizSwingMode();
+  v[kAppCharacteristic_ModeFanOn] = handleModeFanOn();
+  v[kAppCharacteristic_ModeDryOn] = handleModeDryOn();
+
+  v[kAppCharacteristic_ThermostatStatusActive] = active;
+  v[kAppCharacteristic_FanStatusActive] = active;
+  v[kAppCharacteristic_VaneVertStatusActive] = active;
+  v[kAppCharacteristic_VaneHorizStatusActive] = active;
+  v[kAppCharacteristic_ModeFanStatusActive] = active;
+  v[kAppCharacteristic_ModeDryStatusActive] = active;
+}
+
+static void RaiseChangedCharacteristics(void);
+
+static void RateLimitTimer(void *arg) {
+  accessoryConfiguration.rateLimitTimer = MGOS_INVALID_TIMER_ID;
+  RaiseChangedCharacteristics();
+  (void) arg;
+}
+
+static bool RateLimitAllows(AppCharacteristic characteristic, float value) {
+  for (size_t i = 0; i < HAPArrayCount(kAppRateLimits); i++) {
+    const AppRateLimitConfig *config = &kAppRateLimits[i];
+    AppRateLimit *bucket = &accessoryConfiguration.rateLimits[i];
+    if (config->characteristic != characteristic) continue;
+
+    int intervalMs = config->getIntervalMs();
+    float burst = (float) config->getBurst();
+    float delta =
+        value - accessoryConfiguration.published.values[characteristic];
+    float deadband = config->getDeadband();
+    int64_t now = mgos_uptime_micros();
+    if (intervalMs <= 0 || burst < 1) return true;
+    if (!bucket->initialized) {
+      bucket->tokens = burst;
+      bucket->refillUs = now;
+      bucket->initialized = true;
+    }
+    bucket->tokens += (float) (now - bucket->refillUs) / (intervalMs * 1000.0f);
+    if (bucket->tokens > burst) bucket->tokens = burst;
+    bucket->refillUs = now;
+
+    if (bucket->tokens >= 1 || delta >= deadband || -delta >= deadband) {
+      if (bucket->tokens >= 1) bucket->tokens -= 1;
+      bucket->held = false;
+      return true;
+    }
+    // Only a held change replaced by a newer one is never raised.
+    if (bucket->held && bucket->heldValue != value) {
+      mel_stats_event_suppressed();
+    }
+    bucket->held = true;
+    bucket->heldValue = value;
+    if (accessoryConfiguration.rateLimitTimer == MGOS_INVALID_TIMER_ID) {
+      int waitMs = (int) ((1 - bucket->tokens) * intervalMs) + 1;
+      accessoryConfiguration.rateLimitTimer =
+          mgos_set_timer(waitMs, 0, RateLimitTimer, NULL);
+    }
+    return false;
+  }
+  return true;
+}
+
+/**
+ * Raise events for the characteristics that differ from the published state.
+ */
+static void RaiseChangedCharacteristics(void) {
+  const AccessoryState *state = &accessoryConfiguration.snapshot;
+  AccessoryState published = *state;
+
+  for (size_t i = 0; i < kAppCharacteristic_Count; i++) {
+    bool dirty = (accessoryConfiguration.dirty & (1u << i)) != 0;
+    if (accessoryConfiguration.publishedValid && !dirty &&
+        state->values[i] == accessoryConfiguration.published.values[i]) {
+      continue;
+    }
+    if (accessoryConfiguration.publishedValid && !dirty &&
+        !RateLimitAllows((AppCharacteristic) i, state->values[i])) {
+      published.values[i] = accessoryConfiguration.published.values[i];
+      continue;
+    }
+    const HAPSessionRef *writer = accessoryConfiguration.writers[i].session;
+    if (writer != NULL &&
+        accessoryConfiguration.writers[i].value == state->values[i]) {
+      AccessoryNotificationExcept(kAppCharacteristics[i].service,
+                                  kAppCharacteristics[i].characteristic,
+                                  writer);
+    } else {
+      AccessoryNotification(kAppCharacteristics[i].service,
+                            kAppCharacteristics[i].characteristic);
+    }
+  }
+  accessoryConfiguration.published = published;
+  accessoryConfiguration.publishedValid = true;
+  accessoryConfiguration.dirty = 0;
+  HAPRawBufferZero(accessoryConfiguration.writers,
+                   sizeof accessoryConfiguration.writers);
+}
+
+/**
+ * Rebuild the snapshot and raise events for what changed.
+ */
+static void NotifyChangedCharacteristics(void) {
+  GetAccessoryState(&accessoryConfiguration.snapshot);
+  RaiseChangedCharacteristics();
 }
 
 static void led_off_timer_cb(void *arg) {
@@ -1008,76 +1850,88 @@ static void led_on(int msec) {
 }
 
 void mel_cb(int ev, void *ev_data, void *arg) {
+  mel_stats_event(ev, ev_data);
+#if APP_BENCH
+  bench_mel_event(ev, ev_data);
+#endif
   switch (ev) {
     case MGOS_MEL_AC_EV_INITIALIZED:
-      LOG(LL_INFO, ("MEL init done"));
+      APP_LOG(MEL, LL_INFO, ("MEL init done"));
       break;
     case MGOS_MEL_AC_EV_CONNECTED:
-      LOG(LL_INFO, ("connected: %s", *(bool *) ev_data ? "true" : "false"));
+      APP_LOG(MEL, LL_INFO,
+              ("connected: %s", *(bool *) ev_data ? "true" : "false"));
+      if (*(bool *) ev_data) boot_time_mark("mel_connected");
+      if (!*(bool *) ev_data) DropPendingParams();
       if (!accessoryConfiguration.server) goto hap_not_running;
-      handleStatusActive();
+      NotifyChangedCharacteristics();
       break;
     case MGOS_MEL_AC_EV_CONNECT_ERROR:
-      LOG(LL_INFO, ("connect_error: %d", *(uint8_t *) ev_data));
+      APP_LOG(MEL, LL_INFO, ("connect_error: %d", *(uint8_t *) ev_data));
       break;
     case MGOS_MEL_AC_EV_PACKET_WRITE:
-      LOG(LL_DEBUG, ("tx: %s", (char *) ev_data));
+      trace_packet(true, (const char *) ev_data);
+      NoteSetPacket((const char *) ev_data);
+      APP_LOG(MEL, LL_DEBUG, ("tx: %s", (char *) ev_data));
       break;
     case MGOS_MEL_AC_EV_PACKET_READ:
-      LOG(LL_DEBUG, ("rx: %s", (char *) ev_data));
+      trace_packet(false, (const char *) ev_data);
+      APP_LOG(MEL, LL_DEBUG, ("rx: %s", (char *) ev_data));
       break;
     case MGOS_MEL_AC_EV_OPERATING_CHANGED:
-      LOG(LL_INFO, ("opeating: %s", *(bool *) ev_data ? "true" : "false"));
+      APP_LOG(MEL, LL_INFO,
+              ("opeating: %s", *(bool *) ev_data ? "true" : "false"));
       if (!accessoryConfiguration.server) goto hap_not_running;
 
-      AccessoryNotification(&ThermostatService,
-                            &ThermostatCurrentHCstateCharacteristic);
+      NotifyChangedCharacteristics();
       break;
     case MGOS_MEL_AC_EV_PARAMS_SET:
-      LOG(LL_INFO, ("new params aplied to HVAC"));
+      APP_LOG(MEL, LL_INFO, ("new params aplied to HVAC"));
       led_on(mgos_sys_config_get_app_blink_ms_update());
+      ClearPendingParams();
+      SaveHVACState();
+      if (!accessoryConfiguration.server) goto hap_not_running;
+      NotifyChangedCharacteristics();
       break;
     case MGOS_MEL_AC_EV_PARAMS_NOT_SET:
-      LOG(LL_WARN, ("HVAC failed to apply new params"));
+      APP_LOG(MEL, LL_WARN, ("HVAC failed to apply new params"));
+      // Roll back the optimistic values shown to controllers.
+      ClearPendingParams();
+      if (!accessoryConfiguration.server) goto hap_not_running;
+      NotifyChangedCharacteristics();
       break;
     case MGOS_MEL_AC_EV_PARAMS_CHANGED: {
       led_on(mgos_sys_config_get_app_blink_ms_sync());
+      boot_time_mark("mel_params");
+      accessoryConfiguration.lastKnown.stale = false;
+      DropDeferredParams();
+      SaveHVACState();
       if (!accessoryConfiguration.server) goto hap_not_running;
-      // Thermostat
-      handleThermostatService();
-      // Fan
-      handleFanService();
-      // VaneVert
-      handleVaneVertService();
-      // VaneHoriz
-      handleVaneHorizService();
-      // ModeFan
-      handleModeFanService();
-      // ModeDry
-      handleModeDryService();
-
+      NotifyChangedCharacteristics();
     } break;
     case MGOS_MEL_AC_EV_ROOMTEMP_CHANGED: {
       led_on(mgos_sys_config_get_app_blink_ms_room());
-      LOG(LL_INFO, ("room_temp: %.1f", *(float *) ev_data));
+      APP_LOG(MEL, LL_INFO, ("room_temp: %.1f", *(float *) ev_data));
+      accessoryConfiguration.lastKnown.roomTempStale = false;
 
       if (!accessoryConfiguration.server) goto hap_not_running;
 
-      AccessoryNotification(&ThermostatService,
-                            &ThermostatCurrentTempCharacteristic);
+      NotifyChangedCharacteristics();
     } break;
     case MGOS_MEL_AC_EV_PACKET_READ_ERROR:
-      LOG(LL_ERROR, ("error: packet crc"));
+      trace_read_error();
+      APP_LOG(MEL, LL_ERROR, ("error: packet crc"));
       break;
     case MGOS_MEL_AC_EV_TIMER:
       break;
     default:
-      LOG(LL_VERBOSE_DEBUG, ("event: %d", ev));
+      APP_LOG(MEL, LL_VERBOSE_DEBUG, ("event: %d", ev));
   }
   return;
 
 hap_not_running:
-  LOG(LL_WARN, ("HAP server is not running, skipping accessory update"));
+  APP_LOG(MEL, LL_WARN,
+          ("HAP server is not running, skipping accessory update"));
 
   (void) ev_data;
 }
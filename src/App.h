@@ -279,6 +279,11 @@ void RestorePlatformFactorySettings(void);
  */
 HAPAccessory *AppGetAccessoryInfo();
 
+/**
+ * Returns true if HomeKit writes are staged and not yet sent to the HVAC.
+ */
+bool AppHasStagedParams(void);
+
 // LED
 #if CS_PLATFORM == CS_P_ESP32
 #define LED_ON true
@@ -288,6 +293,10 @@ HAPAccessory *AppGetAccessoryInfo();
 #define LED_ON false
 #define LED_OFF true
 #endif
+#ifndef LED_ON
+#define LED_ON true
+#define LED_OFF false
+#endif
 
 // RPC
 void wifi_rpc_start(void);
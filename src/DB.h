@@ -30,6 +30,8 @@ extern const HAPUInt8Characteristic ThermostatCurrentHCstateCharacteristic;
 extern const HAPUInt8Characteristic ThermostatTargetHCstateCharacteristic;
 extern const HAPFloatCharacteristic ThermostatCurrentTempCharacteristic;
 extern const HAPFloatCharacteristic ThermostatTargetTempCharacteristic;
+extern const HAPUInt8Characteristic
+    ThermostatTemperatureDisplayUnitsCharacteristic;
 extern const HAPBoolCharacteristic ThermostatStatusActiveCharacteristic;
 
 extern HAPService VaneVertService;
@@ -6,6 +6,12 @@
 
 #include "App.h"
 #include "DB.h"
+#include "adv_sched.h"
+#include "app_log.h"
+#include "app_store.h"
+#include "bench.h"
+#include "boot_time.h"
+#include "heap_mon.h"
 #include "HAP.h"
 #include "HAPPlatform+Init.h"
 #include "HAPPlatformAccessorySetup+Init.h"
@@ -19,23 +25,34 @@
 #endif
 
 #include "HAP+Internal.h"
+#include "common/mbuf.h"
 #include "mgos.h"
-#include "mgos_dns_sd.h"
 #include "mgos_hap.h"
+#include "mgos_rpc.h"
 #ifdef MGOS_HAVE_WIFI
 #include "mgos_wifi.h"
 #endif
 #include "mgos_mel_ac.h"
+#include "mel_stats.h"
 #include "reset_btn.h"
+#include "trace.h"
 
 static bool requestedFactoryReset;
 static bool clearPairings;
 
-#define MAX_NUM_SESSIONS 16
+// HAP requires at least 8 concurrent IP sessions.
+#define MIN_NUM_SESSIONS 8
 
 #define PREFERRED_ADVERTISING_INTERVAL \
   (HAPBLEAdvertisingIntervalCreateFromMilliseconds(417.5f))
 
+#if IP
+static size_t GetMaxNumSessions(void) {
+  int n = mgos_sys_config_get_app_ip_max_sessions();
+  return n < MIN_NUM_SESSIONS ? MIN_NUM_SESSIONS : (size_t) n;
+}
+#endif
+
 /**
  * Global platform objects.
  * Only tracks objects that will be released in DeinitializePlatform.
@@ -77,6 +94,7 @@ extern void AppDeinitialize();
 extern void AppAccessoryServerStart(void);
 extern void AccessoryServerHandleUpdatedState(HAPAccessoryServerRef *server,
                                               void *_Nullable context);
+#ifdef MGOS_HAVE_WIFI
 /* WiFi last event*/
 static int wifi_state = MGOS_WIFI_EV_STA_DISCONNECTED;
 
@@ -111,20 +129,23 @@ static void wifi_timer_cb(void *arg) {
   mgos_gpio_blink(mgos_sys_config_get_pins_led(), on_ms, off_ms);
   (void) arg;
 }
+#endif /* MGOS_HAVE_WIFI */
 
 static void net_cb(int ev, void *evd, void *arg) {
   switch (ev) {
     case MGOS_NET_EV_DISCONNECTED:
-      LOG(LL_INFO, ("%s", "Net disconnected"));
+      APP_LOG(PLATFORM, LL_INFO, ("%s", "Net disconnected"));
       break;
     case MGOS_NET_EV_CONNECTING:
-      LOG(LL_INFO, ("%s", "Net connecting..."));
+      APP_LOG(PLATFORM, LL_INFO, ("%s", "Net connecting..."));
       break;
     case MGOS_NET_EV_CONNECTED:
-      LOG(LL_INFO, ("%s", "Net connected"));
+      APP_LOG(PLATFORM, LL_INFO, ("%s", "Net connected"));
       break;
     case MGOS_NET_EV_IP_ACQUIRED:
-      LOG(LL_INFO, ("%s", "Net got IP address"));
+      APP_LOG(PLATFORM, LL_INFO, ("%s", "Net got IP address"));
+      boot_time_mark("ip_acquired");
+      adv_sched_trigger("ip");
       break;
   }
 
@@ -139,34 +160,36 @@ static void wifi_cb(int ev, void *evd, void *arg) {
     case MGOS_WIFI_EV_STA_DISCONNECTED: {
       struct mgos_wifi_sta_disconnected_arg *da =
           (struct mgos_wifi_sta_disconnected_arg *) evd;
-      LOG(LL_INFO, ("WiFi STA disconnected, reason %d", da->reason));
+      APP_LOG(PLATFORM, LL_INFO,
+              ("WiFi STA disconnected, reason %d", da->reason));
       break;
     }
     case MGOS_WIFI_EV_STA_CONNECTING:
-      LOG(LL_INFO, ("WiFi STA connecting %p", arg));
+      APP_LOG(PLATFORM, LL_INFO, ("WiFi STA connecting %p", arg));
       break;
     case MGOS_WIFI_EV_STA_CONNECTED:
-      LOG(LL_INFO, ("WiFi STA connected %p", arg));
+      APP_LOG(PLATFORM, LL_INFO, ("WiFi STA connected %p", arg));
       break;
     case MGOS_WIFI_EV_STA_IP_ACQUIRED:
-      LOG(LL_INFO,
-          ("WiFi STA IP acquired: %s", mgos_sys_config_get_wifi_ap_ip()));
+      APP_LOG(PLATFORM, LL_INFO,
+              ("WiFi STA IP acquired: %s", mgos_sys_config_get_wifi_ap_ip()));
       break;
     case MGOS_WIFI_EV_AP_STA_CONNECTED: {
       struct mgos_wifi_ap_sta_connected_arg *aa =
           (struct mgos_wifi_ap_sta_connected_arg *) evd;
-      LOG(LL_INFO, ("WiFi AP STA connected MAC %02x:%02x:%02x:%02x:%02x:%02x",
-                    aa->mac[0], aa->mac[1], aa->mac[2], aa->mac[3], aa->mac[4],
-                    aa->mac[5]));
+      APP_LOG(PLATFORM, LL_INFO,
+              ("WiFi AP STA connected MAC %02x:%02x:%02x:%02x:%02x:%02x",
+               aa->mac[0], aa->mac[1], aa->mac[2], aa->mac[3], aa->mac[4],
+               aa->mac[5]));
       break;
     }
     case MGOS_WIFI_EV_AP_STA_DISCONNECTED: {
       struct mgos_wifi_ap_sta_disconnected_arg *aa =
           (struct mgos_wifi_ap_sta_disconnected_arg *) evd;
-      LOG(LL_INFO,
-          ("WiFi AP STA disconnected MAC %02x:%02x:%02x:%02x:%02x:%02x",
-           aa->mac[0], aa->mac[1], aa->mac[2], aa->mac[3], aa->mac[4],
-           aa->mac[5]));
+      APP_LOG(PLATFORM, LL_INFO,
+              ("WiFi AP STA disconnected MAC %02x:%02x:%02x:%02x:%02x:%02x",
+               aa->mac[0], aa->mac[1], aa->mac[2], aa->mac[3], aa->mac[4],
+               aa->mac[5]));
       break;
     }
   }
@@ -174,22 +197,121 @@ static void wifi_cb(int ev, void *evd, void *arg) {
 }
 #endif /* MGOS_HAVE_WIFI */
 
-static void timer_cb(void *arg) {
-  static bool s_tick_tock = false;
-  LOG(LL_INFO,
-      ("%s uptime: %.2lf, RAM: %lu, %lu free", (s_tick_tock ? "Tick" : "Tock"),
-       mgos_uptime(), (unsigned long) mgos_get_heap_size(),
-       (unsigned long) mgos_get_free_heap_size()));
-  s_tick_tock = !s_tick_tock;
-  (void) arg;
+#if IP
+/**
+ * IP session table. When a new connection takes the last free session, the
+ * least recently used idle session (no activity for app.ip.reap_idle_ms) is
+ * closed so the next controller can connect without waiting for a dead
+ * one to time out.
+ */
+static struct {
+  HAPIPSession *sessions;
+  size_t numSessions;
+  HAPTime *reapStamps;  // Activity stamp at reap time, 0 if not reaped.
+  size_t peakOpen;
+  uint32_t numAccepted;
+  uint32_t numReaped;
+} ipSessionTable;
+
+static HAPIPSessionDescriptor *GetIPSessionDescriptor(size_t i) {
+  return (HAPIPSessionDescriptor *) &ipSessionTable.sessions[i].descriptor;
 }
 
-static void adv_timer_cb(void *arg) {
-  if (!HAPAccessoryServerIsPaired(HAPNonnull(&accessoryServer))) {
-    LOG(LL_DEBUG, ("Advertising accessory"));
-    mgos_dns_sd_advertise();
+static size_t CountOpenIPSessions(void) {
+  size_t numOpen = 0;
+  for (size_t i = 0; i < ipSessionTable.numSessions; i++) {
+    const HAPIPSessionDescriptor *descriptor = GetIPSessionDescriptor(i);
+    if (descriptor->server && descriptor->tcpStreamIsOpen) numOpen++;
   }
-  (void) arg;
+  return numOpen;
+}
+
+static void ReapIdleIPSession(void) {
+  HAPTime now = HAPPlatformClockGetCurrent();
+  HAPTime minIdle = (HAPTime) mgos_sys_config_get_app_ip_reap_idle_ms();
+  size_t lru = ipSessionTable.numSessions;
+
+  for (size_t i = 0; i < ipSessionTable.numSessions; i++) {
+    const HAPIPSessionDescriptor *descriptor = GetIPSessionDescriptor(i);
+    if (!descriptor->server || !descriptor->tcpStreamIsOpen) continue;
+    if (descriptor->state != kHAPIPSessionState_Idle) continue;
+    if (ipSessionTable.reapStamps[i] == descriptor->stamp) continue;
+    if (now - descriptor->stamp < minIdle) continue;
+    if (lru == ipSessionTable.numSessions ||
+        descriptor->stamp < GetIPSessionDescriptor(lru)->stamp) {
+      lru = i;
+    }
+  }
+  if (lru == ipSessionTable.numSessions) {
+    APP_LOG(PLATFORM, LL_WARN, ("IP sessions full, none idle to reap"));
+    return;
+  }
+  HAPIPSessionDescriptor *descriptor = GetIPSessionDescriptor(lru);
+  APP_LOG(PLATFORM, LL_INFO,
+          ("Reaping IP session %u, idle for %lu ms", (unsigned) lru,
+           (unsigned long) (now - descriptor->stamp)));
+  ipSessionTable.reapStamps[lru] = descriptor->stamp;
+  ipSessionTable.numReaped++;
+  HAPPlatformTCPStreamCloseOutput(&platform.tcpStreamManager,
+                                  descriptor->tcpStream);
+}
+
+static void HandleIPSessionAccept(HAPAccessoryServerRef *server,
+                                  HAPSessionRef *session,
+                                  void *_Nullable context) {
+  AccessoryServerHandleSessionAccept(server, session, context);
+  adv_sched_pairing_check();
+
+  size_t numOpen = CountOpenIPSessions();
+  ipSessionTable.numAccepted++;
+  if (numOpen > ipSessionTable.peakOpen) ipSessionTable.peakOpen = numOpen;
+  if (numOpen >= ipSessionTable.numSessions) ReapIdleIPSession();
+}
+
+static void ip_sessions_rpc_handler(struct mg_rpc_request_info *ri,
+                                    void *cb_arg,
+                                    struct mg_rpc_frame_info *fi,
+                                    struct mg_str args) {
+  struct mbuf buf;
+  struct json_out out = JSON_OUT_MBUF(&buf);
+  HAPTime now = HAPPlatformClockGetCurrent();
+  size_t numOpen = 0;
+
+  mbuf_init(&buf, 16 * ipSessionTable.numSessions);
+  json_printf(&out, "[");
+  for (size_t i = 0; i < ipSessionTable.numSessions; i++) {
+    const HAPIPSessionDescriptor *descriptor = GetIPSessionDescriptor(i);
+    if (!descriptor->server || !descriptor->tcpStreamIsOpen) continue;
+    json_printf(&out, "%s%lu", (numOpen++ ? ", " : ""),
+                (unsigned long) (now - descriptor->stamp));
+  }
+  json_printf(&out, "]");
+  mg_rpc_send_responsef(ri,
+                        "{size: %u, open: %u, utilization_pct: %u, peak: %u, "
+                        "accepted: %u, reaped: %u, idle_ms: %.*s}",
+                        (unsigned) ipSessionTable.numSessions,
+                        (unsigned) numOpen,
+                        (unsigned) (numOpen * 100 / ipSessionTable.numSessions),
+                        (unsigned) ipSessionTable.peakOpen,
+                        (unsigned) ipSessionTable.numAccepted,
+                        (unsigned) ipSessionTable.numReaped, (int) buf.len,
+                        buf.buf);
+  mbuf_free(&buf);
+  (void) cb_arg;
+  (void) fi;
+  (void) args;
+}
+#endif
+
+/**
+ * Pairings are added and removed over a session, re-announce when the state
+ * changed.
+ */
+static void HandleSessionInvalidate(HAPAccessoryServerRef *server,
+                                    HAPSessionRef *session,
+                                    void *_Nullable context) {
+  AccessoryServerHandleSessionInvalidate(server, session, context);
+  adv_sched_pairing_check();
 }
 
 /**
@@ -202,6 +324,9 @@ static void InitializePlatform() {
       &(const HAPPlatformKeyValueStoreOptions){.fileName = "kv.json"});
   platform.hapPlatform.keyValueStore = &platform.keyValueStore;
 
+  // App records, write-behind on top of the key-value store.
+  app_store_init(&platform.keyValueStore);
+
   // Accessory setup manager. Depends on key-value store.
   static HAPPlatformAccessorySetup accessorySetup;
   HAPPlatformAccessorySetupCreate(&accessorySetup,
@@ -215,7 +340,7 @@ static void InitializePlatform() {
       &(const HAPPlatformTCPStreamManagerOptions){
           .port = kHAPNetworkPort_Any,  // Listen on unused port number from the
                                         // ephemeral port range.
-          .maxConcurrentTCPStreams = MAX_NUM_SESSIONS});
+          .maxConcurrentTCPStreams = GetMaxNumSessions()});
 
   // Service discovery.
   static HAPPlatformServiceDiscovery serviceDiscovery;
@@ -242,8 +367,17 @@ static void InitializePlatform() {
       kHAPPairingStorage_MinElements;
 
   platform.hapAccessoryServerCallbacks.handleUpdatedState = HandleUpdatedState;
+#if IP
+  platform.hapAccessoryServerCallbacks.handleSessionAccept =
+      HandleIPSessionAccept;
+#else
+  platform.hapAccessoryServerCallbacks.handleSessionAccept =
+      AccessoryServerHandleSessionAccept;
+#endif
+  platform.hapAccessoryServerCallbacks.handleSessionInvalidate =
+      HandleSessionInvalidate;
 
-  mgos_set_timer(1000, MGOS_TIMER_REPEAT, timer_cb, NULL);
+  heap_mon_init();
 }
 
 /**
@@ -272,6 +406,10 @@ void RestorePlatformFactorySettings(void) {
  */
 void HandleUpdatedState(HAPAccessoryServerRef *_Nonnull server,
                         void *_Nullable context) {
+  if (HAPAccessoryServerGetState(server) == kHAPAccessoryServerState_Running) {
+    boot_time_mark("hap_running");
+    adv_sched_pairing_check();
+  }
   if (HAPAccessoryServerGetState(server) == kHAPAccessoryServerState_Idle &&
       requestedFactoryReset) {
     HAPPrecondition(server);
@@ -287,6 +425,7 @@ void HandleUpdatedState(HAPAccessoryServerRef *_Nonnull server,
       HAPAssert(err == kHAPError_Unknown);
       HAPFatalError();
     }
+    app_store_purge();
 
     // Reset HomeKit state.
     err = HAPRestoreFactorySettings(&platform.keyValueStore);
@@ -326,14 +465,28 @@ void HandleUpdatedState(HAPAccessoryServerRef *_Nonnull server,
 
 #if IP
 static void InitializeIP() {
-  // Prepare accessory server storage.
-  static HAPIPSession ipSessions[MAX_NUM_SESSIONS];
-  static uint8_t ipScratchBuffer[2048];
-  static HAPIPAccessoryServerStorage ipAccessoryServerStorage = {
-      .sessions = ipSessions,
-      .numSessions = HAPArrayCount(ipSessions),
-      .scratchBuffer = {.bytes = ipScratchBuffer,
-                        .numBytes = sizeof ipScratchBuffer}};
+  // Prepare accessory server storage. Sized from the config, session buffers
+  // are allocated by the accessory server when a controller connects.
+  size_t numSessions = GetMaxNumSessions();
+  size_t numScratchBytes = mgos_sys_config_get_app_ip_scratch_bytes();
+  static HAPIPAccessoryServerStorage ipAccessoryServerStorage;
+  HAPIPSession *ipSessions = calloc(numSessions, sizeof(*ipSessions));
+  uint8_t *ipScratchBuffer = calloc(1, numScratchBytes);
+  HAPAssert(ipSessions != NULL && ipScratchBuffer != NULL);
+  ipAccessoryServerStorage.sessions = ipSessions;
+  ipAccessoryServerStorage.numSessions = numSessions;
+  ipAccessoryServerStorage.scratchBuffer.bytes = ipScratchBuffer;
+  ipAccessoryServerStorage.scratchBuffer.numBytes = numScratchBytes;
+  ipSessionTable.sessions = ipSessions;
+  ipSessionTable.numSessions = numSessions;
+  ipSessionTable.reapStamps = calloc(numSessions, sizeof(HAPTime));
+  HAPAssert(ipSessionTable.reapStamps != NULL);
+  APP_LOG(PLATFORM, LL_INFO,
+          ("IP storage: %u sessions x %u + %u scratch = %u bytes, %lu free",
+           (unsigned) numSessions, (unsigned) sizeof(*ipSessions),
+           (unsigned) numScratchBytes,
+           (unsigned) (numSessions * sizeof(*ipSessions) + numScratchBytes),
+           (unsigned long) mgos_get_free_heap_size()));
 
   platform.hapAccessoryServerOptions.ip.transport =
       &kHAPAccessoryServerTransport_IP;
@@ -375,37 +528,57 @@ static void InitializeBLE() {
 }
 #endif
 
+/**
+ * First start after provisioning: the library skipped its init because
+ * mel_ac.enable was off. Release the debug console if it shares the UART,
+ * then start the library in place instead of restarting. The restart is
+ * kept as a fallback if the library fails to start.
+ */
+static void EnableMelAC(void) {
+  APP_LOG(PLATFORM, LL_INFO, ("Updating config..."));
+  /* Config */
+  if (mgos_sys_config_get_mel_ac_uart_no() == 0) {
+    mgos_sys_config_set_debug_stdout_uart(-1);
+    mgos_sys_config_set_debug_stderr_uart(-1);
+    mgos_set_stdout_uart(-1);
+    mgos_set_stderr_uart(-1);
+  }
+  mgos_sys_config_set_mel_ac_enable(true);
+  mgos_sys_config_save(&mgos_sys_config, false, NULL);
+  if (!mgos_mel_ac_init()) {
+    APP_LOG(PLATFORM, LL_ERROR, ("MEL-AC init failed, restarting"));
+    mgos_system_restart();
+    return;
+  }
+  boot_time_mark("mel_ac_enabled");
+}
+
 enum mgos_app_init_result mgos_app_init(void) {
+  boot_time_init();
   /* LED */
   mgos_gpio_set_mode(mgos_sys_config_get_pins_led(), MGOS_GPIO_MODE_OUTPUT);
   mgos_gpio_write(mgos_sys_config_get_pins_led(), LED_OFF);
+#ifdef MGOS_HAVE_WIFI
   mgos_set_timer(1000, MGOS_TIMER_REPEAT, wifi_timer_cb, NULL);
   /* Captive */
   if (mgos_sys_config_get_wifi_ap_enable()) {
-    LOG(LL_WARN, ("Runing captive portal to setup WiFi"));
+    APP_LOG(PLATFORM, LL_WARN, ("Runing captive portal to setup WiFi"));
     return MGOS_APP_INIT_SUCCESS;
   };
-  if (!mgos_sys_config_get_mel_ac_enable()) {
-    LOG(LL_INFO, ("Updating config..."));
-    /* Config */
-    if (mgos_sys_config_get_mel_ac_uart_no() == 0) {
-      mgos_sys_config_set_debug_stdout_uart(-1);
-      mgos_sys_config_set_debug_stderr_uart(-1);
-    }
-    mgos_sys_config_set_mel_ac_enable(true);
-    mgos_sys_config_save(&mgos_sys_config, false, NULL);
-    mgos_system_restart();  // Its better to restart
-  }
-  LOG(LL_INFO, ("Starting services..."));
+#endif
+  APP_LOG(PLATFORM, LL_INFO, ("Starting services..."));
   /* MEL-AC events */
   mgos_event_add_group_handler(MGOS_EVENT_GRP_MEL_AC, mel_cb, NULL);
+  if (!mgos_sys_config_get_mel_ac_enable()) EnableMelAC();
   /* HAP */
   HAPAssert(HAPGetCompatibilityVersion() == HAP_COMPATIBILITY_VERSION);
   // Initialize global platform objects.
   InitializePlatform();
+  boot_time_mark("platform");
 
 #if IP
   InitializeIP();
+  boot_time_mark("ip");
 #endif
 
 #if BLE
@@ -422,20 +595,33 @@ enum mgos_app_init_result mgos_app_init(void) {
       &accessoryServer, &platform.hapAccessoryServerOptions,
       &platform.hapPlatform, &platform.hapAccessoryServerCallbacks,
       /* context: */ NULL);
+  boot_time_mark("server_create");
 
   // Create app object.
   AppCreate(&accessoryServer, &platform.keyValueStore);
+  boot_time_mark("app_create");
 
   // Start accessory server for App.
   if (mgos_hap_config_valid()) {
     // MDNS lost queries workaround
-    mgos_set_timer(2000, MGOS_TIMER_REPEAT, adv_timer_cb, NULL);
+    adv_sched_init(&accessoryServer);
     AppAccessoryServerStart();
+    boot_time_mark("server_start");
   } else {
-    LOG(LL_INFO, ("=== Accessory is not provisioned"));
+    APP_LOG(PLATFORM, LL_INFO, ("=== Accessory is not provisioned"));
   }
 
   mgos_hap_add_rpc_service(&accessoryServer, AppGetAccessoryInfo());
+  trace_init();
+  mel_stats_init();
+#if IP
+  mg_rpc_add_handler(mgos_rpc_get_global(), "MelAC.Sessions", "",
+                     ip_sessions_rpc_handler, NULL);
+#endif
+
+#if APP_BENCH
+  bench_init(&accessoryServer, &platform.keyValueStore);
+#endif
 
   mgos_mel_ac_reset_button_init();
 
@@ -0,0 +1,169 @@
+/*
+ * Copyright (c) 2014-2018 Cesanta Software Limited
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "adv_sched.h"
+
+#include <strings.h>
+
+#include "app_log.h"
+#include "mgos.h"
+#include "mgos_dns_sd.h"
+#include "mgos_mdns.h"
+#include "mgos_rpc.h"
+
+#define ADV_SCHED_SERVICE "_hap._tcp.local"
+
+static struct {
+  HAPAccessoryServerRef *server;
+  bool paired;
+  mgos_timer_id timer;
+  int interval_ms; /* Delay before the next scheduled announcement */
+  int burst_left;  /* Announcements left at app.adv.min_ms */
+  int64_t next_us;
+  int64_t last_us; /* Last announcement, 0 if none */
+  const char *reason;
+  uint32_t announcements;
+  uint32_t bursts;
+  uint32_t queries;
+  uint32_t query_announcements;
+  uint32_t queries_capped; /* Matching queries within app.adv.min_ms */
+} s_adv;
+
+static void adv_sched_timer_cb(void *arg);
+
+static void adv_sched_arm(int delay_ms) {
+  if (s_adv.timer != MGOS_INVALID_TIMER_ID) mgos_clear_timer(s_adv.timer);
+  s_adv.timer = mgos_set_timer(delay_ms, 0, adv_sched_timer_cb, NULL);
+  s_adv.next_us = mgos_uptime_micros() + (int64_t) delay_ms * 1000;
+}
+
+static void adv_sched_stop(void) {
+  if (s_adv.timer != MGOS_INVALID_TIMER_ID) mgos_clear_timer(s_adv.timer);
+  s_adv.timer = MGOS_INVALID_TIMER_ID;
+  s_adv.next_us = 0;
+}
+
+static void adv_sched_announce(void) {
+  APP_LOG(PLATFORM, LL_DEBUG, ("Advertising accessory (%s)", s_adv.reason));
+  mgos_dns_sd_advertise();
+  s_adv.announcements++;
+  s_adv.last_us = mgos_uptime_micros();
+}
+
+static void adv_sched_timer_cb(void *arg) {
+  int max_ms = mgos_sys_config_get_app_adv_max_ms();
+  s_adv.timer = MGOS_INVALID_TIMER_ID;
+  s_adv.next_us = 0;
+  adv_sched_pairing_check();
+  if (s_adv.paired) return;
+  adv_sched_announce();
+  if (s_adv.burst_left > 0) {
+    s_adv.burst_left--;
+  } else if (s_adv.interval_ms < max_ms) {
+    s_adv.interval_ms *= 2;
+    if (s_adv.interval_ms > max_ms) s_adv.interval_ms = max_ms;
+  }
+  adv_sched_arm(s_adv.interval_ms);
+  (void) arg;
+}
+
+void adv_sched_trigger(const char *reason) {
+  if (s_adv.server == NULL) return;
+  s_adv.paired = HAPAccessoryServerIsPaired(s_adv.server);
+  if (s_adv.paired) {
+    adv_sched_stop();
+    return;
+  }
+  s_adv.reason = reason;
+  s_adv.interval_ms = mgos_sys_config_get_app_adv_min_ms();
+  s_adv.burst_left = mgos_sys_config_get_app_adv_burst() - 1;
+  s_adv.bursts++;
+  APP_LOG(PLATFORM, LL_INFO, ("Advertising burst: %s", reason));
+  adv_sched_arm(s_adv.interval_ms);
+}
+
+void adv_sched_pairing_check(void) {
+  if (s_adv.server == NULL) return;
+  if (HAPAccessoryServerIsPaired(s_adv.server) != s_adv.paired) {
+    adv_sched_trigger("pairing");
+  }
+}
+
+/*
+ * Re-announces at once on a query for HAP services. A query within
+ * app.adv.min_ms of the last announcement, scheduled or not, is left to the
+ * responder, so a chatty network cannot drive more than one announcement
+ * per app.adv.min_ms.
+ */
+static void adv_sched_mdns_handler(struct mg_connection *nc, int ev,
+                                   void *ev_data, void *user_data) {
+  struct mg_dns_message *msg = (struct mg_dns_message *) ev_data;
+  int64_t min_us = (int64_t) mgos_sys_config_get_app_adv_min_ms() * 1000;
+  char name[64];
+  bool match = false;
+
+  if (ev != MG_DNS_MESSAGE || (msg->flags & 0x8000) || s_adv.paired) return;
+  for (int i = 0; i < msg->num_questions && !match; i++) {
+    if (mg_dns_uncompress_name(msg, &msg->questions[i].name, name,
+                               sizeof(name)) == 0) {
+      continue;
+    }
+    match = strcasecmp(name, ADV_SCHED_SERVICE) == 0;
+  }
+  if (!match) return;
+  s_adv.queries++;
+  if (s_adv.last_us != 0 && mgos_uptime_micros() - s_adv.last_us < min_us) {
+    s_adv.queries_capped++;
+    return;
+  }
+  s_adv.reason = "query";
+  s_adv.query_announcements++;
+  adv_sched_announce();
+  (void) nc;
+  (void) user_data;
+}
+
+static void adv_sched_rpc_handler(struct mg_rpc_request_info *ri,
+                                  void *cb_arg, struct mg_rpc_frame_info *fi,
+                                  struct mg_str args) {
+  long next_ms = -1;
+  if (s_adv.next_us != 0) {
+    next_ms = (long) ((s_adv.next_us - mgos_uptime_micros()) / 1000);
+  }
+  mg_rpc_send_responsef(
+      ri,
+      "{paired: %B, reason: %Q, interval_ms: %d, next_ms: %ld, "
+      "announcements: %u, bursts: %u, queries: %u, "
+      "query_announcements: %u, queries_capped: %u}",
+      s_adv.paired, (s_adv.reason ? s_adv.reason : ""), s_adv.interval_ms,
+      next_ms, (unsigned) s_adv.announcements, (unsigned) s_adv.bursts,
+      (unsigned) s_adv.queries, (unsigned) s_adv.query_announcements,
+      (unsigned) s_adv.queries_capped);
+  (void) cb_arg;
+  (void) fi;
+  (void) args;
+}
+
+bool adv_sched_init(HAPAccessoryServerRef *server) {
+  s_adv.server = server;
+  s_adv.timer = MGOS_INVALID_TIMER_ID;
+  mgos_mdns_add_handler(adv_sched_mdns_handler, NULL);
+  mg_rpc_add_handler(mgos_rpc_get_global(), "MelAC.Adv", "",
+                     adv_sched_rpc_handler, NULL);
+  adv_sched_trigger("boot");
+  return true;
+}
@@ -0,0 +1,50 @@
+/*
+ * Copyright (c) 2014-2018 Cesanta Software Limited
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+
+#include "HAP.h"
+
+/*
+ * mDNS announcements of the unpaired accessory.
+ *
+ * Some controllers miss the accessory when mDNS packets are lost, so it is
+ * re-announced while unpaired. A burst of app.adv.burst announcements
+ * app.adv.min_ms apart is sent after boot, IP acquisition and pairing state
+ * changes, then the interval doubles up to app.adv.max_ms. A query for
+ * _hap._tcp re-announces at once, unless an announcement went out within
+ * app.adv.min_ms: the cap keeps a flood of queries from becoming a flood
+ * of announcements. Nothing is sent while paired: the mDNS responder
+ * answers queries as usual.
+ *
+ * adv_sched_trigger() and adv_sched_pairing_check() do nothing before
+ * adv_sched_init(), so network event handlers may call them before the
+ * accessory server exists (or when it is never created, in captive portal
+ * mode).
+ *
+ * MelAC.Adv reports the schedule and the announcement counters.
+ */
+
+bool adv_sched_init(HAPAccessoryServerRef *server);
+
+/* Starts a new burst, reason is a string literal used in logs */
+void adv_sched_trigger(const char *reason);
+
+/* Starts a new burst if the accessory was paired or unpaired */
+void adv_sched_pairing_check(void);
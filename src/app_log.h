@@ -0,0 +1,55 @@
+/*
+ * Copyright (c) 2014-2018 Cesanta Software Limited
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "mgos.h"
+
+/*
+ * Compile-time log levels per subsystem, set from mos.yml cdefs:
+ *   APP_LOG_LEVEL_HANDLERS  - HAP read / write handlers
+ *   APP_LOG_LEVEL_NOTIFY    - HAP event notifications
+ *   APP_LOG_LEVEL_MEL       - MEL-AC events
+ *   APP_LOG_LEVEL_PLATFORM  - network, WiFi, heap and boot messages
+ * Values are cs_log levels: -1 none, 0 error, 1 warn, 2 info, 3 debug,
+ * 4 verbose debug. Messages above the subsystem level are removed by the
+ * compiler together with their arguments; the rest are still subject to the
+ * runtime debug.level.
+ */
+
+#ifndef APP_LOG_LEVEL_HANDLERS
+#define APP_LOG_LEVEL_HANDLERS LL_VERBOSE_DEBUG
+#endif
+
+#ifndef APP_LOG_LEVEL_NOTIFY
+#define APP_LOG_LEVEL_NOTIFY LL_VERBOSE_DEBUG
+#endif
+
+#ifndef APP_LOG_LEVEL_MEL
+#define APP_LOG_LEVEL_MEL LL_VERBOSE_DEBUG
+#endif
+
+#ifndef APP_LOG_LEVEL_PLATFORM
+#define APP_LOG_LEVEL_PLATFORM LL_VERBOSE_DEBUG
+#endif
+
+#define APP_LOG(subsys, l, x)                         \
+  do {                                                \
+    if ((int) (l) <= (int) APP_LOG_LEVEL_##subsys) { \
+      LOG(l, x);                                      \
+    }                                                 \
+  } while (0)
@@ -0,0 +1,308 @@
+/*
+ * Copyright (c) 2014-2018 Cesanta Software Limited
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "app_store.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "hist.h"
+#include "mgos.h"
+#include "mgos_rpc.h"
+
+/* Domain the app records were kept in by older firmware, see App.c */
+#define APP_STORE_LEGACY_DOMAIN ((HAPPlatformKeyValueStoreDomain) 0x00)
+
+#define APP_STORE_SLOT_MAGIC 0xA5
+
+struct app_store_slot {
+  uint8_t magic; /* APP_STORE_SLOT_MAGIC, anything else is a free slot */
+  uint8_t key;
+  uint8_t len;
+  uint8_t sum; /* 0xFF minus the byte sum of key, len and data */
+  uint8_t data[APP_STORE_MAX_RECORD];
+};
+
+static struct {
+  HAPPlatformKeyValueStoreRef kv;
+  struct app_store_slot slots[APP_STORE_NUM_SLOTS];
+  bool file_ok;    /* File exists with all slots */
+  uint32_t dirty;  /* Slots to write */
+  uint32_t legacy; /* Slots to remove from the HAP key-value store */
+  mgos_timer_id timer;
+  uint32_t sets;
+  uint32_t unchanged; /* Sets equal to the cached record */
+  uint32_t coalesced; /* Sets to a record that was not written yet */
+  uint32_t flushes;
+  uint32_t flush_errors;
+  uint32_t records_written;
+  uint64_t bytes_written;
+  struct hist flush;
+} s_store;
+
+static uint8_t app_store_sum(const struct app_store_slot *slot) {
+  uint8_t sum = slot->key + slot->len;
+  for (int i = 0; i < slot->len; i++) sum += slot->data[i];
+  return 0xFF - sum;
+}
+
+static bool app_store_slot_valid(const struct app_store_slot *slot) {
+  return slot->magic == APP_STORE_SLOT_MAGIC &&
+         slot->len <= APP_STORE_MAX_RECORD &&
+         slot->sum == app_store_sum(slot);
+}
+
+/* Slot holding the key, or the first free one if create is set */
+static int app_store_find(uint8_t key, bool create) {
+  int free_slot = -1;
+  for (int i = 0; i < APP_STORE_NUM_SLOTS; i++) {
+    if (s_store.slots[i].magic != APP_STORE_SLOT_MAGIC) {
+      if (free_slot < 0) free_slot = i;
+    } else if (s_store.slots[i].key == key) {
+      return i;
+    }
+  }
+  return create ? free_slot : -1;
+}
+
+static void app_store_timer_cb(void *arg) {
+  s_store.timer = MGOS_INVALID_TIMER_ID;
+  app_store_flush();
+  (void) arg;
+}
+
+static void app_store_schedule(void) {
+  int delay_ms = mgos_sys_config_get_app_store_flush_ms();
+  if (delay_ms <= 0) {
+    app_store_flush();
+  } else if (s_store.timer == MGOS_INVALID_TIMER_ID) {
+    s_store.timer = mgos_set_timer(delay_ms, 0, app_store_timer_cb, NULL);
+  }
+}
+
+static bool app_store_put(uint8_t key, const void *buf, size_t size) {
+  struct app_store_slot slot;
+  int i;
+
+  if (size > APP_STORE_MAX_RECORD) {
+    LOG(LL_ERROR, ("record %u: %u bytes, max %d", key, (unsigned) size,
+                   APP_STORE_MAX_RECORD));
+    return false;
+  }
+  i = app_store_find(key, true);
+  if (i < 0) {
+    LOG(LL_ERROR, ("record %u: no free slot", key));
+    return false;
+  }
+  memset(&slot, 0, sizeof(slot));
+  slot.magic = APP_STORE_SLOT_MAGIC;
+  slot.key = key;
+  slot.len = (uint8_t) size;
+  memcpy(slot.data, buf, size);
+  slot.sum = app_store_sum(&slot);
+  s_store.sets++;
+  if (memcmp(&slot, &s_store.slots[i], sizeof(slot)) == 0) {
+    s_store.unchanged++;
+    return true;
+  }
+  if (s_store.dirty & (1u << i)) s_store.coalesced++;
+  s_store.slots[i] = slot;
+  s_store.dirty |= 1u << i;
+  app_store_schedule();
+  return true;
+}
+
+/* Moves a record written by older firmware out of the HAP key-value store */
+static int app_store_import(uint8_t key) {
+  uint8_t buf[APP_STORE_MAX_RECORD];
+  size_t num_bytes = 0;
+  bool found = false;
+  int i;
+
+  if (HAPPlatformKeyValueStoreGet(s_store.kv, APP_STORE_LEGACY_DOMAIN, key,
+                                  buf, sizeof(buf), &num_bytes, &found) !=
+          kHAPError_None ||
+      !found || !app_store_put(key, buf, num_bytes)) {
+    return -1;
+  }
+  i = app_store_find(key, false);
+  s_store.legacy |= 1u << i;
+  LOG(LL_INFO, ("record %u: %u bytes moved from the key-value store", key,
+                (unsigned) num_bytes));
+  return i;
+}
+
+bool app_store_get(uint8_t key, void *buf, size_t size, size_t *num_bytes) {
+  int i = app_store_find(key, false);
+  if (i < 0) i = app_store_import(key);
+  if (i < 0 || s_store.slots[i].len > size) return false;
+  memcpy(buf, s_store.slots[i].data, s_store.slots[i].len);
+  if (num_bytes != NULL) *num_bytes = s_store.slots[i].len;
+  return true;
+}
+
+bool app_store_set(uint8_t key, const void *buf, size_t size) {
+  return app_store_put(key, buf, size);
+}
+
+bool app_store_remove(uint8_t key) {
+  int i = app_store_find(key, false);
+  if (i < 0) return false;
+  memset(&s_store.slots[i], 0, sizeof(s_store.slots[i]));
+  s_store.dirty |= 1u << i;
+  app_store_schedule();
+  return true;
+}
+
+bool app_store_flush(void) {
+  int64_t start = mgos_uptime_micros();
+  uint32_t written = 0;
+  bool ok = true;
+  FILE *fp;
+
+  if (s_store.timer != MGOS_INVALID_TIMER_ID) {
+    mgos_clear_timer(s_store.timer);
+    s_store.timer = MGOS_INVALID_TIMER_ID;
+  }
+  if (s_store.dirty == 0) return true;
+  /* A missing or short file is written whole once, then only changed slots */
+  if (!s_store.file_ok) s_store.dirty = (1u << APP_STORE_NUM_SLOTS) - 1;
+  fp = fopen(APP_STORE_FILE_NAME, s_store.file_ok ? "r+b" : "wb");
+  if (fp == NULL) {
+    ok = false;
+  } else {
+    for (int i = 0; i < APP_STORE_NUM_SLOTS && ok; i++) {
+      if (!(s_store.dirty & (1u << i))) continue;
+      ok = fseek(fp, (long) (i * sizeof(s_store.slots[i])), SEEK_SET) == 0 &&
+           fwrite(&s_store.slots[i], sizeof(s_store.slots[i]), 1, fp) == 1;
+      written++;
+    }
+    if (fclose(fp) != 0) ok = false;
+  }
+  if (!ok) {
+    s_store.flush_errors++;
+    s_store.file_ok = false;
+    LOG(LL_ERROR, ("%s: write failed", APP_STORE_FILE_NAME));
+    if (mgos_sys_config_get_app_store_flush_ms() > 0) app_store_schedule();
+    return false;
+  }
+  s_store.file_ok = true;
+  s_store.dirty = 0;
+  s_store.flushes++;
+  s_store.records_written += written;
+  s_store.bytes_written += written * sizeof(s_store.slots[0]);
+  hist_add(&s_store.flush, (uint32_t) (mgos_uptime_micros() - start));
+  for (int i = 0; i < APP_STORE_NUM_SLOTS && s_store.legacy != 0; i++) {
+    if (!(s_store.legacy & (1u << i))) continue;
+    s_store.legacy &= ~(1u << i);
+    (void) HAPPlatformKeyValueStoreRemove(s_store.kv, APP_STORE_LEGACY_DOMAIN,
+                                          s_store.slots[i].key);
+  }
+  return true;
+}
+
+void app_store_purge(void) {
+  if (s_store.timer != MGOS_INVALID_TIMER_ID) {
+    mgos_clear_timer(s_store.timer);
+    s_store.timer = MGOS_INVALID_TIMER_ID;
+  }
+  memset(s_store.slots, 0, sizeof(s_store.slots));
+  s_store.dirty = 0;
+  s_store.legacy = 0;
+  s_store.file_ok = false;
+  remove(APP_STORE_FILE_NAME);
+}
+
+uint64_t app_store_bytes_written(void) {
+  return s_store.bytes_written;
+}
+
+static void app_store_load(void) {
+  FILE *fp = fopen(APP_STORE_FILE_NAME, "rb");
+  int used = 0;
+
+  if (fp == NULL) return;
+  s_store.file_ok = fread(s_store.slots, sizeof(s_store.slots), 1, fp) == 1;
+  fclose(fp);
+  if (!s_store.file_ok) {
+    memset(s_store.slots, 0, sizeof(s_store.slots));
+    LOG(LL_WARN, ("%s: short file, ignored", APP_STORE_FILE_NAME));
+    return;
+  }
+  for (int i = 0; i < APP_STORE_NUM_SLOTS; i++) {
+    if (app_store_slot_valid(&s_store.slots[i])) {
+      used++;
+    } else {
+      memset(&s_store.slots[i], 0, sizeof(s_store.slots[i]));
+    }
+  }
+  LOG(LL_INFO, ("%s: %d records", APP_STORE_FILE_NAME, used));
+}
+
+static void app_store_reboot_cb(int ev, void *ev_data, void *userdata) {
+  app_store_flush();
+  (void) ev;
+  (void) ev_data;
+  (void) userdata;
+}
+
+static void app_store_rpc_handler(struct mg_rpc_request_info *ri,
+                                  void *cb_arg, struct mg_rpc_frame_info *fi,
+                                  struct mg_str args) {
+  bool reset = false;
+  int used = 0;
+  uint32_t changes;
+
+  json_scanf(args.p, args.len, ri->args_fmt, &reset);
+  for (int i = 0; i < APP_STORE_NUM_SLOTS; i++) {
+    if (s_store.slots[i].magic == APP_STORE_SLOT_MAGIC) used++;
+  }
+  changes = s_store.sets - s_store.unchanged;
+  mg_rpc_send_responsef(
+      ri,
+      "{flush_ms: %d, slots: %d, used: %d, dirty: %B, sets: %u, "
+      "unchanged: %u, coalesced: %u, flushes: %u, flush_errors: %u, "
+      "records_written: %u, bytes_written: %lu, bytes_per_change: %.1f, "
+      "flush: %M}",
+      mgos_sys_config_get_app_store_flush_ms(), APP_STORE_NUM_SLOTS, used,
+      s_store.dirty != 0, (unsigned) s_store.sets,
+      (unsigned) s_store.unchanged, (unsigned) s_store.coalesced,
+      (unsigned) s_store.flushes, (unsigned) s_store.flush_errors,
+      (unsigned) s_store.records_written,
+      (unsigned long) s_store.bytes_written,
+      changes ? (double) s_store.bytes_written / changes : 0.0, hist_json,
+      &s_store.flush);
+  if (reset) {
+    s_store.sets = s_store.unchanged = s_store.coalesced = 0;
+    s_store.flushes = s_store.flush_errors = s_store.records_written = 0;
+    s_store.bytes_written = 0;
+    hist_reset(&s_store.flush);
+  }
+  (void) cb_arg;
+  (void) fi;
+}
+
+bool app_store_init(HAPPlatformKeyValueStoreRef kv) {
+  s_store.kv = kv;
+  s_store.timer = MGOS_INVALID_TIMER_ID;
+  hist_reset(&s_store.flush);
+  app_store_load();
+  mgos_event_add_handler(MGOS_EVENT_REBOOT, app_store_reboot_cb, NULL);
+  mg_rpc_add_handler(mgos_rpc_get_global(), "MelAC.Store", "{reset: %B}",
+                     app_store_rpc_handler, NULL);
+  return true;
+}
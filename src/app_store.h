@@ -0,0 +1,64 @@
+/*
+ * Copyright (c) 2014-2018 Cesanta Software Limited
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "HAP.h"
+
+/*
+ * Write-behind store for the small app records (accessory state, last HVAC
+ * state).
+ *
+ * Records live in a RAM cache. app_store_set() only updates the cache;
+ * changed records are written app.store.flush_ms later, so a burst of
+ * changes costs one flash write. Pending records are also written on reboot
+ * (including OTA) and by app_store_flush().
+ *
+ * On flash the records are fixed 32 byte slots of a small binary file,
+ * updated in place, instead of a rewrite of the whole kv.json. Records found
+ * in the HAP key-value store (older firmware) are moved over on first use.
+ *
+ * MelAC.Store {reset: B} reports the cache state, the flash writes and the
+ * flush latency.
+ */
+
+#define APP_STORE_FILE_NAME "app.bin"
+#define APP_STORE_NUM_SLOTS 4
+#define APP_STORE_MAX_RECORD 28
+
+bool app_store_init(HAPPlatformKeyValueStoreRef kv);
+
+/* Returns true and fills buf if the record exists and fits */
+bool app_store_get(uint8_t key, void *buf, size_t size, size_t *num_bytes);
+
+/* Updates the cached record, the flash write is deferred */
+bool app_store_set(uint8_t key, const void *buf, size_t size);
+
+bool app_store_remove(uint8_t key);
+
+/* Writes pending records now */
+bool app_store_flush(void);
+
+/* Drops all records, on factory reset */
+void app_store_purge(void);
+
+/* Bytes written to flash since boot or the last MelAC.Store reset */
+uint64_t app_store_bytes_written(void);
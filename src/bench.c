@@ -0,0 +1,481 @@
+/*
+ * Copyright (c) 2014-2018 Cesanta Software Limited
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "bench.h"
+
+#if APP_BENCH
+
+#include <string.h>
+#include <sys/stat.h>
+
+#include "App.h"
+#include "DB.h"
+#include "app_log.h"
+#include "app_store.h"
+#include "hist.h"
+#include "mgos.h"
+#include "mgos_mel_ac.h"
+#include "mgos_rpc.h"
+#include "trace.h"
+
+#define BENCH_TIMEOUT_MS 10000
+#define BENCH_GAP_MS 500
+#define BENCH_PKT_TYPE_SET 0x41
+#define BENCH_READ_HANDLERS 8
+
+static HAPAccessoryServerRef *s_server = NULL;
+static HAPPlatformKeyValueStoreRef s_kv = NULL;
+/* Never matches a real controller session */
+static HAPSessionRef s_session;
+
+static struct {
+  struct mg_rpc_request_info *ri;
+  int runs;
+  int step;    /* Next entry of the step sequence */
+  int done;    /* Steps that sent a SET, timed out or failed */
+  int skipped; /* Steps that matched the unit state and sent nothing */
+  int timeouts;
+  int failures;
+  int64_t write_us;
+  bool waiting;
+  bool tx_seen;
+  mgos_timer_id timer;
+  struct hist write_to_tx;
+  struct hist write_to_set;
+} s_run;
+
+static struct {
+  int64_t changed_us;
+  bool pending;
+  struct hist changed_to_event;
+} s_reverse;
+
+static HAPError bench_write_target_temp(int phase) {
+  const HAPFloatCharacteristicWriteRequest request = {
+      .transportType = kHAPTransportType_IP,
+      .session = &s_session,
+      .characteristic = &ThermostatTargetTempCharacteristic,
+      .service = &ThermostatService,
+      .accessory = AppGetAccessoryInfo()};
+  return HandleThermostatTargetTempWrite(s_server, &request,
+                                         phase ? 23.0f : 22.0f, NULL);
+}
+
+static HAPError bench_write_target_hc_state(int phase) {
+  const HAPUInt8CharacteristicWriteRequest request = {
+      .transportType = kHAPTransportType_IP,
+      .session = &s_session,
+      .characteristic = &ThermostatTargetHCstateCharacteristic,
+      .service = &ThermostatService,
+      .accessory = AppGetAccessoryInfo()};
+  return HandleThermostatTargetHCstateWrite(
+      s_server, &request,
+      phase ? kHAPCharacteristicValue_TargetHeatingCoolingState_Heat
+            : kHAPCharacteristicValue_TargetHeatingCoolingState_Cool,
+      NULL);
+}
+
+static HAPError bench_write_fan_speed(int phase) {
+  const HAPFloatCharacteristicWriteRequest request = {
+      .transportType = kHAPTransportType_IP,
+      .session = &s_session,
+      .characteristic = &FanRotationSpeedCharacteristic,
+      .service = &FanService,
+      .accessory = AppGetAccessoryInfo()};
+  return HandleFanRotationSpeedWrite(s_server, &request, phase ? 75.0f : 25.0f,
+                                     NULL);
+}
+
+static HAPError bench_write_fan_target_state(int phase) {
+  const HAPUInt8CharacteristicWriteRequest request = {
+      .transportType = kHAPTransportType_IP,
+      .session = &s_session,
+      .characteristic = &FanTargetSateCharacteristic,
+      .service = &FanService,
+      .accessory = AppGetAccessoryInfo()};
+  return HandleFanTargetStateWrite(
+      s_server, &request,
+      phase ? kHAPCharacteristicValue_TargetFanState_Auto
+            : kHAPCharacteristicValue_TargetFanState_Manual,
+      NULL);
+}
+
+static HAPError bench_write_vane_vert(int phase) {
+  const HAPIntCharacteristicWriteRequest request = {
+      .transportType = kHAPTransportType_IP,
+      .session = &s_session,
+      .characteristic = &VaneVertTargetTiltAngleCharacteristic,
+      .service = &VaneVertService,
+      .accessory = AppGetAccessoryInfo()};
+  return HandleVaneVertTargetTiltAngleWrite(s_server, &request,
+                                            phase ? 45 : -45, NULL);
+}
+
+static HAPError bench_write_vane_horiz(int phase) {
+  const HAPIntCharacteristicWriteRequest request = {
+      .transportType = kHAPTransportType_IP,
+      .session = &s_session,
+      .characteristic = &VaneHorizTargetTiltAngleCharacteristic,
+      .service = &VaneHorizService,
+      .accessory = AppGetAccessoryInfo()};
+  return HandleVaneHorizTargetTiltAngleWrite(s_server, &request,
+                                             phase ? 45 : -45, NULL);
+}
+
+/* First entry powers the unit on, the rest need it running */
+static HAPError (*const s_steps[])(int phase) = {
+    bench_write_target_hc_state, bench_write_target_temp,
+    bench_write_fan_speed,       bench_write_fan_target_state,
+    bench_write_vane_vert,       bench_write_vane_horiz,
+};
+
+/* Packet type is the second byte */
+static int bench_packet_type(const char *hex) {
+  uint8_t header[2];
+  if (trace_decode(hex, header, sizeof(header)) < (int) sizeof(header)) {
+    return -1;
+  }
+  return header[1];
+}
+
+static void bench_next_cb(void *arg);
+
+static void bench_finish(void) {
+  struct mg_rpc_request_info *ri = s_run.ri;
+  s_run.ri = NULL;
+  s_run.waiting = false;
+  if (s_run.timer != MGOS_INVALID_TIMER_ID) mgos_clear_timer(s_run.timer);
+  s_run.timer = MGOS_INVALID_TIMER_ID;
+  mg_rpc_send_responsef(ri,
+                        "{runs: %d, skipped: %d, timeouts: %d, failures: %d, "
+                        "write_to_tx: %M, write_to_set: %M, "
+                        "changed_to_event: %M}",
+                        s_run.done, s_run.skipped, s_run.timeouts,
+                        s_run.failures, hist_json, &s_run.write_to_tx,
+                        hist_json, &s_run.write_to_set, hist_json,
+                        &s_reverse.changed_to_event);
+}
+
+static void bench_step_done(void) {
+  s_run.waiting = false;
+  if (s_run.timer != MGOS_INVALID_TIMER_ID) mgos_clear_timer(s_run.timer);
+  s_run.timer = MGOS_INVALID_TIMER_ID;
+  s_run.step++;
+  if (++s_run.done >= s_run.runs) {
+    bench_finish();
+    return;
+  }
+  s_run.timer = mgos_set_timer(BENCH_GAP_MS, 0, bench_next_cb, NULL);
+}
+
+static void bench_timeout_cb(void *arg) {
+  s_run.timer = MGOS_INVALID_TIMER_ID;
+  LOG(LL_WARN, ("bench: step %d timed out", s_run.step));
+  s_run.timeouts++;
+  bench_step_done();
+  (void) arg;
+}
+
+static void bench_next_cb(void *arg) {
+  int n = (int) (sizeof(s_steps) / sizeof(s_steps[0]));
+  int step = s_run.step % n;
+  int phase = (s_run.step / n) & 1;
+
+  s_run.timer = MGOS_INVALID_TIMER_ID;
+  if (!mgos_mel_ac_get_connected()) {
+    mg_rpc_send_errorf(s_run.ri, -1, "HVAC is not connected");
+    s_run.ri = NULL;
+    return;
+  }
+  s_run.tx_seen = false;
+  s_run.waiting = true;
+  s_run.timer = mgos_set_timer(BENCH_TIMEOUT_MS, 0, bench_timeout_cb, NULL);
+  s_run.write_us = mgos_uptime_micros();
+  if (s_steps[step](phase) != kHAPError_None) {
+    s_run.failures++;
+    bench_step_done();
+  } else if (!AppHasStagedParams()) {
+    /*
+     * The value was already set (dropped as a no-op) or deferred while the
+     * unit is off: no SET follows, so the step is not counted.
+     */
+    s_run.waiting = false;
+    mgos_clear_timer(s_run.timer);
+    s_run.step++;
+    if (++s_run.skipped > s_run.runs + 2 * n) {
+      mg_rpc_send_errorf(s_run.ri, -1, "HVAC does not take the writes");
+      s_run.ri = NULL;
+      return;
+    }
+    s_run.timer = mgos_set_timer(0, 0, bench_next_cb, NULL);
+  }
+  (void) arg;
+}
+
+static void bench_rpc_handler(struct mg_rpc_request_info *ri, void *cb_arg,
+                              struct mg_rpc_frame_info *fi,
+                              struct mg_str args) {
+  int runs = 60;
+  json_scanf(args.p, args.len, ri->args_fmt, &runs);
+  if (s_run.ri != NULL) {
+    mg_rpc_send_errorf(ri, 409, "benchmark is already running");
+    return;
+  }
+  if (runs <= 0) {
+    mg_rpc_send_errorf(ri, 400, "runs must be positive");
+    return;
+  }
+  s_run.ri = ri;
+  s_run.runs = runs;
+  s_run.step = 0;
+  s_run.done = 0;
+  s_run.skipped = 0;
+  s_run.timeouts = 0;
+  s_run.failures = 0;
+  s_run.timer = MGOS_INVALID_TIMER_ID;
+  hist_reset(&s_run.write_to_tx);
+  hist_reset(&s_run.write_to_set);
+  hist_reset(&s_reverse.changed_to_event);
+  LOG(LL_INFO, ("bench: starting %d runs", runs));
+  bench_next_cb(NULL);
+  (void) cb_arg;
+  (void) fi;
+}
+
+/* One pass over the read handlers HomeKit polls when the Home app opens */
+static void bench_read_sweep(void) {
+  const HAPAccessory *accessory = AppGetAccessoryInfo();
+  const HAPFloatCharacteristicReadRequest current_temp = {
+      .transportType = kHAPTransportType_IP,
+      .session = &s_session,
+      .characteristic = &ThermostatCurrentTempCharacteristic,
+      .service = &ThermostatService,
+      .accessory = accessory};
+  const HAPFloatCharacteristicReadRequest target_temp = {
+      .transportType = kHAPTransportType_IP,
+      .session = &s_session,
+      .characteristic = &ThermostatTargetTempCharacteristic,
+      .service = &ThermostatService,
+      .accessory = accessory};
+  const HAPUInt8CharacteristicReadRequest current_state = {
+      .transportType = kHAPTransportType_IP,
+      .session = &s_session,
+      .characteristic = &ThermostatCurrentHCstateCharacteristic,
+      .service = &ThermostatService,
+      .accessory = accessory};
+  const HAPUInt8CharacteristicReadRequest target_state = {
+      .transportType = kHAPTransportType_IP,
+      .session = &s_session,
+      .characteristic = &ThermostatTargetHCstateCharacteristic,
+      .service = &ThermostatService,
+      .accessory = accessory};
+  const HAPFloatCharacteristicReadRequest fan_speed = {
+      .transportType = kHAPTransportType_IP,
+      .session = &s_session,
+      .characteristic = &FanRotationSpeedCharacteristic,
+      .service = &FanService,
+      .accessory = accessory};
+  const HAPIntCharacteristicReadRequest vane_vert = {
+      .transportType = kHAPTransportType_IP,
+      .session = &s_session,
+      .characteristic = &VaneVertTargetTiltAngleCharacteristic,
+      .service = &VaneVertService,
+      .accessory = accessory};
+  const HAPIntCharacteristicReadRequest vane_horiz = {
+      .transportType = kHAPTransportType_IP,
+      .session = &s_session,
+      .characteristic = &VaneHorizTargetTiltAngleCharacteristic,
+      .service = &VaneHorizService,
+      .accessory = accessory};
+  const HAPBoolCharacteristicReadRequest mode_fan = {
+      .transportType = kHAPTransportType_IP,
+      .session = &s_session,
+      .characteristic = &ModeFanOnCharacteristic,
+      .service = &ModeFanService,
+      .accessory = accessory};
+  float f;
+  uint8_t u;
+  int32_t i;
+  bool b;
+
+  (void) HandleThermostatCurrentTempRead(s_server, &current_temp, &f, NULL);
+  (void) HandleThermostatTargetTempRead(s_server, &target_temp, &f, NULL);
+  (void) HandleThermostatCurrentHCstateRead(s_server, &current_state, &u,
+                                            NULL);
+  (void) HandleThermostatTargetHCstateRead(s_server, &target_state, &u, NULL);
+  (void) HandleFanRotationSpeedRead(s_server, &fan_speed, &f, NULL);
+  (void) HandleVaneVertTargetTiltAngleRead(s_server, &vane_vert, &i, NULL);
+  (void) HandleVaneHorizTargetTiltAngleRead(s_server, &vane_horiz, &i, NULL);
+  (void) HandleModeFanOnRead(s_server, &mode_fan, &b, NULL);
+}
+
+static void bench_reads_rpc_handler(struct mg_rpc_request_info *ri,
+                                    void *cb_arg, struct mg_rpc_frame_info *fi,
+                                    struct mg_str args) {
+  struct hist sweep;
+  int iterations = 100;
+  json_scanf(args.p, args.len, ri->args_fmt, &iterations);
+  if (iterations <= 0) {
+    mg_rpc_send_errorf(ri, 400, "iterations must be positive");
+    return;
+  }
+  hist_reset(&sweep);
+  for (int n = 0; n < iterations; n++) {
+    int64_t start = mgos_uptime_micros();
+    bench_read_sweep();
+    hist_add(&sweep, (uint32_t) (mgos_uptime_micros() - start));
+  }
+  mg_rpc_send_responsef(ri,
+                        "{iterations: %d, handlers: %d, log_levels: "
+                        "{handlers: %d, notify: %d, mel: %d, platform: %d}, "
+                        "sweep: %M}",
+                        iterations, BENCH_READ_HANDLERS,
+                        (int) APP_LOG_LEVEL_HANDLERS,
+                        (int) APP_LOG_LEVEL_NOTIFY, (int) APP_LOG_LEVEL_MEL,
+                        (int) APP_LOG_LEVEL_PLATFORM, hist_json, &sweep);
+  (void) cb_arg;
+  (void) fi;
+}
+
+void bench_mel_event(int ev, void *ev_data) {
+  int64_t now = mgos_uptime_micros();
+  switch (ev) {
+    case MGOS_MEL_AC_EV_PACKET_WRITE:
+      if (s_run.waiting && !s_run.tx_seen &&
+          bench_packet_type((const char *) ev_data) == BENCH_PKT_TYPE_SET) {
+        s_run.tx_seen = true;
+        hist_add(&s_run.write_to_tx, (uint32_t) (now - s_run.write_us));
+      }
+      break;
+    case MGOS_MEL_AC_EV_PARAMS_SET:
+      if (!s_run.waiting) break;
+      hist_add(&s_run.write_to_set, (uint32_t) (now - s_run.write_us));
+      bench_step_done();
+      break;
+    case MGOS_MEL_AC_EV_PARAMS_NOT_SET:
+      if (!s_run.waiting) break;
+      s_run.failures++;
+      bench_step_done();
+      break;
+    case MGOS_MEL_AC_EV_PARAMS_CHANGED:
+      s_reverse.changed_us = now;
+      s_reverse.pending = true;
+      break;
+  }
+}
+
+void bench_event_raised(void) {
+  if (!s_reverse.pending) return;
+  s_reverse.pending = false;
+  hist_add(&s_reverse.changed_to_event,
+           (uint32_t) (mgos_uptime_micros() - s_reverse.changed_us));
+}
+
+/*
+ * Scratch record, removed after the run. The key-value store copy goes to the
+ * last domain the ADK leaves to the accessory, the app never uses it.
+ */
+#define BENCH_STORE_KEY 0xFE
+#define BENCH_STORE_DOMAIN ((HAPPlatformKeyValueStoreDomain) 0x7F)
+#define BENCH_STORE_RECORD 10
+
+static long bench_file_size(const char *name) {
+  struct stat st;
+  return stat(name, &st) == 0 ? (long) st.st_size : 0;
+}
+
+/*
+ * Each iteration makes `burst` changes to a record the size of the HVAC state
+ * record. The key-value store path writes every change the way the app did
+ * before the app store; the app store path writes the burst with one flush.
+ */
+static void bench_store_rpc_handler(struct mg_rpc_request_info *ri,
+                                    void *cb_arg, struct mg_rpc_frame_info *fi,
+                                    struct mg_str args) {
+  struct hist kv_write, store_flush;
+  uint64_t kv_bytes = 0, store_bytes;
+  uint8_t record[BENCH_STORE_RECORD];
+  int iterations = 20, burst = 5, changes;
+  json_scanf(args.p, args.len, ri->args_fmt, &iterations, &burst);
+  if (iterations <= 0 || burst <= 0) {
+    mg_rpc_send_errorf(ri, 400, "iterations and burst must be positive");
+    return;
+  }
+  changes = iterations * burst;
+  hist_reset(&kv_write);
+  hist_reset(&store_flush);
+  memset(record, 0, sizeof(record));
+  for (int n = 0; n < changes; n++) {
+    int64_t start = mgos_uptime_micros();
+    record[0] = (uint8_t) n;
+    if (HAPPlatformKeyValueStoreSet(s_kv, BENCH_STORE_DOMAIN, BENCH_STORE_KEY,
+                                    record, sizeof(record)) != kHAPError_None) {
+      mg_rpc_send_errorf(ri, 500, "key-value store write failed");
+      return;
+    }
+    hist_add(&kv_write, (uint32_t) (mgos_uptime_micros() - start));
+    /* The whole file is rewritten */
+    kv_bytes += bench_file_size("kv.json");
+  }
+  (void) HAPPlatformKeyValueStoreRemove(s_kv, BENCH_STORE_DOMAIN,
+                                        BENCH_STORE_KEY);
+  (void) app_store_flush();
+  store_bytes = app_store_bytes_written();
+  for (int n = 0; n < iterations; n++) {
+    int64_t start;
+    for (int i = 0; i < burst; i++) {
+      record[0] = (uint8_t) (n * burst + i);
+      if (!app_store_set(BENCH_STORE_KEY, record, sizeof(record))) {
+        mg_rpc_send_errorf(ri, 500, "app store is full");
+        return;
+      }
+    }
+    start = mgos_uptime_micros();
+    if (!app_store_flush()) {
+      mg_rpc_send_errorf(ri, 500, "app store write failed");
+      return;
+    }
+    hist_add(&store_flush, (uint32_t) (mgos_uptime_micros() - start));
+  }
+  store_bytes = app_store_bytes_written() - store_bytes;
+  (void) app_store_remove(BENCH_STORE_KEY);
+  (void) app_store_flush();
+  mg_rpc_send_responsef(
+      ri,
+      "{iterations: %d, burst: %d, kv: {writes: %d, bytes_per_change: %.1f, "
+      "write: %M}, store: {writes: %d, bytes_per_change: %.1f, flush: %M}}",
+      iterations, burst, changes, (double) kv_bytes / changes, hist_json,
+      &kv_write, iterations, (double) store_bytes / changes, hist_json,
+      &store_flush);
+  (void) cb_arg;
+  (void) fi;
+}
+
+void bench_init(HAPAccessoryServerRef *server,
+                HAPPlatformKeyValueStoreRef kv) {
+  s_server = server;
+  s_kv = kv;
+  mg_rpc_add_handler(mgos_rpc_get_global(), "MelAC.Bench", "{runs: %d}",
+                     bench_rpc_handler, NULL);
+  mg_rpc_add_handler(mgos_rpc_get_global(), "MelAC.BenchReads",
+                     "{iterations: %d}", bench_reads_rpc_handler, NULL);
+  mg_rpc_add_handler(mgos_rpc_get_global(), "MelAC.BenchStore",
+                     "{iterations: %d, burst: %d}", bench_store_rpc_handler,
+                     NULL);
+}
+
+#endif /* APP_BENCH */
@@ -0,0 +1,49 @@
+/*
+ * Copyright (c) 2014-2018 Cesanta Software Limited
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "HAP.h"
+
+/*
+ * End-to-end latency benchmark, built with APP_BENCH=1 only.
+ *
+ * MelAC.Bench {runs: N} drives the HAP write handlers and measures
+ *  - write_to_tx: handler call to the first SET packet on the UART
+ *  - write_to_set: handler call to MGOS_MEL_AC_EV_PARAMS_SET
+ *  - changed_to_event: MGOS_MEL_AC_EV_PARAMS_CHANGED to the first
+ *    HAPAccessoryServerRaiseEvent
+ * and responds with p50/p95/p99 histograms in microseconds.
+ *
+ * MelAC.BenchReads {iterations: N} times synchronous sweeps over the HAP read
+ * handlers, to compare builds with different APP_LOG_LEVEL_* settings.
+ *
+ * MelAC.BenchStore {iterations: N, burst: N} compares the flash writes of
+ * bursts of record changes through the HAP key-value store and through the
+ * write-behind app store: latency and bytes written per change.
+ */
+
+#if APP_BENCH
+void bench_init(HAPAccessoryServerRef *server,
+                HAPPlatformKeyValueStoreRef kv);
+
+/* Called from mel_cb for every MEL-AC event */
+void bench_mel_event(int ev, void *ev_data);
+
+/* Called right before HAPAccessoryServerRaiseEvent */
+void bench_event_raised(void);
+#endif
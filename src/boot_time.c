@@ -0,0 +1,91 @@
+/*
+ * Copyright (c) 2014-2018 Cesanta Software Limited
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "boot_time.h"
+
+#include <string.h>
+
+#include "app_log.h"
+#include "mgos.h"
+#include "mgos_rpc.h"
+
+static struct {
+  struct {
+    const char *phase;
+    int64_t us;
+  } marks[BOOT_TIME_MAX_PHASES];
+  int num_marks;
+} s_boot;
+
+int64_t boot_time_get(const char *phase) {
+  for (int i = 0; i < s_boot.num_marks; i++) {
+    if (strcmp(s_boot.marks[i].phase, phase) == 0) return s_boot.marks[i].us;
+  }
+  return -1;
+}
+
+void boot_time_mark(const char *phase) {
+  int64_t now = mgos_uptime_micros();
+  if (boot_time_get(phase) >= 0 || s_boot.num_marks == BOOT_TIME_MAX_PHASES) {
+    return;
+  }
+  s_boot.marks[s_boot.num_marks].phase = phase;
+  s_boot.marks[s_boot.num_marks].us = now;
+  s_boot.num_marks++;
+  APP_LOG(PLATFORM, LL_INFO,
+          ("boot: %s at %lu ms", phase, (unsigned long) (now / 1000)));
+}
+
+static int boot_time_json(struct json_out *out, va_list *ap) {
+  int len = 0;
+  int64_t prev = 0;
+  for (int i = 0; i < s_boot.num_marks; i++) {
+    len += json_printf(out, "%s{phase: %Q, ms: %lu, delta_ms: %lu}",
+                       (i > 0 ? ", " : ""), s_boot.marks[i].phase,
+                       (unsigned long) (s_boot.marks[i].us / 1000),
+                       (unsigned long) ((s_boot.marks[i].us - prev) / 1000));
+    prev = s_boot.marks[i].us;
+  }
+  (void) ap;
+  return len;
+}
+
+static void boot_time_rpc_handler(struct mg_rpc_request_info *ri,
+                                  void *cb_arg, struct mg_rpc_frame_info *fi,
+                                  struct mg_str args) {
+  int64_t running = boot_time_get("hap_running");
+  int64_t params = boot_time_get("mel_params");
+  long controllable_ms = -1;
+
+  if (running >= 0 && params >= 0) {
+    controllable_ms = (long) ((running > params ? running : params) / 1000);
+  }
+  mg_rpc_send_responsef(
+      ri, "{uptime_ms: %lu, controllable_ms: %ld, phases: [%M]}",
+      (unsigned long) (mgos_uptime_micros() / 1000), controllable_ms,
+      boot_time_json);
+  (void) cb_arg;
+  (void) fi;
+  (void) args;
+}
+
+bool boot_time_init(void) {
+  boot_time_mark("app_init");
+  mg_rpc_add_handler(mgos_rpc_get_global(), "MelAC.Boot", "",
+                     boot_time_rpc_handler, NULL);
+  return true;
+}
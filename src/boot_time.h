@@ -0,0 +1,53 @@
+/*
+ * Copyright (c) 2014-2018 Cesanta Software Limited
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Boot phase timing.
+ *
+ * boot_time_mark() records the uptime of the first occurrence of a phase and
+ * logs it. Phases, in the usual order:
+ *  - app_init: mgos_app_init entered
+ *  - mel_ac_enabled: MEL-AC started in place on the first boot after
+ *    provisioning
+ *  - platform, ip: HAP platform objects and IP storage created
+ *  - server_create, app_create: accessory server and app objects created
+ *  - server_start: accessory server start requested
+ *  - hap_running: accessory server running, the first HAP advertisement
+ *    goes out
+ *  - ip_acquired: station IP address
+ *  - mel_connected: first MGOS_MEL_AC_EV_CONNECTED
+ *  - mel_params: first MGOS_MEL_AC_EV_PARAMS_CHANGED, the HVAC state is known
+ *
+ * MelAC.Boot returns the timeline and "controllable_ms", when both
+ * hap_running and mel_params were reached (-1 before).
+ */
+
+#define BOOT_TIME_MAX_PHASES 16
+
+/* Registers MelAC.Boot and marks app_init */
+bool boot_time_init(void);
+
+/* phase must be a string literal */
+void boot_time_mark(const char *phase);
+
+/* Microseconds since boot of the phase, -1 if not reached yet */
+int64_t boot_time_get(const char *phase);
@@ -0,0 +1,157 @@
+/*
+ * Copyright (c) 2014-2018 Cesanta Software Limited
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "heap_mon.h"
+
+#include "app_log.h"
+#include "common/mbuf.h"
+#include "common/platform.h"
+#include "mgos.h"
+#include "mgos_rpc.h"
+
+#if CS_PLATFORM == CS_P_ESP32
+#include "esp_heap_caps.h"
+#elif CS_PLATFORM == CS_P_ESP8266
+#include "umm_malloc.h"
+/* umm_malloc block size, maxFreeContiguousBlocks is counted in these */
+#define HEAP_MON_UMM_BLOCK_SIZE 8
+#endif
+
+#ifndef HEAP_MON_HISTORY
+#define HEAP_MON_HISTORY 32
+#endif
+
+struct heap_sample {
+  uint32_t uptime_s;
+  uint32_t free;
+  uint32_t largest;
+  uint8_t sessions;
+};
+
+static struct {
+  struct heap_sample history[HEAP_MON_HISTORY];
+  uint32_t num_samples; /* Next slot is num_samples % HEAP_MON_HISTORY */
+  uint32_t min_free;
+  uint32_t min_largest;
+  uint32_t warnings;
+  int num_sessions;
+  bool warned;
+} s_heap;
+
+static uint32_t heap_mon_largest_block(void) {
+#if CS_PLATFORM == CS_P_ESP32
+  return (uint32_t) heap_caps_get_largest_free_block(MALLOC_CAP_8BIT);
+#elif CS_PLATFORM == CS_P_ESP8266
+  umm_info(NULL, 0);
+  return (uint32_t) ummHeapInfo.maxFreeContiguousBlocks *
+         HEAP_MON_UMM_BLOCK_SIZE;
+#else
+  return (uint32_t) mgos_get_free_heap_size();
+#endif
+}
+
+static int heap_mon_frag_pct(const struct heap_sample *s) {
+  if (s->free == 0 || s->largest >= s->free) return 0;
+  return (int) (100 - (uint64_t) s->largest * 100 / s->free);
+}
+
+static void heap_mon_sample(void) {
+  struct heap_sample *s =
+      &s_heap.history[s_heap.num_samples++ % HEAP_MON_HISTORY];
+  int frag_pct, warn_pct = mgos_sys_config_get_app_heap_frag_warn_pct();
+
+  s->uptime_s = (uint32_t) mgos_uptime();
+  s->free = (uint32_t) mgos_get_free_heap_size();
+  s->largest = heap_mon_largest_block();
+  s->sessions = (uint8_t) s_heap.num_sessions;
+  s_heap.min_free = (uint32_t) mgos_get_min_free_heap_size();
+  if (s_heap.min_largest == 0 || s->largest < s_heap.min_largest) {
+    s_heap.min_largest = s->largest;
+  }
+  frag_pct = heap_mon_frag_pct(s);
+  APP_LOG(PLATFORM, LL_DEBUG,
+          ("heap: %lu free, %lu min, %lu largest, %d%% frag, %d sessions",
+           (unsigned long) s->free, (unsigned long) s_heap.min_free,
+           (unsigned long) s->largest, frag_pct, s_heap.num_sessions));
+  if (warn_pct <= 0) return;
+  if (frag_pct >= warn_pct && !s_heap.warned) {
+    s_heap.warned = true;
+    s_heap.warnings++;
+    APP_LOG(PLATFORM, LL_WARN,
+            ("heap fragmented: %d%% (largest block %lu of %lu free)",
+             frag_pct, (unsigned long) s->largest, (unsigned long) s->free));
+  } else if (frag_pct < warn_pct) {
+    s_heap.warned = false;
+  }
+}
+
+static void heap_mon_timer_cb(void *arg) {
+  heap_mon_sample();
+  (void) arg;
+}
+
+void heap_mon_sessions(int num_sessions) {
+  s_heap.num_sessions = num_sessions;
+  if (mgos_sys_config_get_app_heap_enable()) heap_mon_sample();
+}
+
+static void heap_mon_rpc_handler(struct mg_rpc_request_info *ri, void *cb_arg,
+                                 struct mg_rpc_frame_info *fi,
+                                 struct mg_str args) {
+  struct mbuf buf;
+  struct json_out out = JSON_OUT_MBUF(&buf);
+  const struct heap_sample *last;
+  uint32_t count, first;
+
+  heap_mon_sample();
+  last = &s_heap.history[(s_heap.num_samples - 1) % HEAP_MON_HISTORY];
+  count = s_heap.num_samples < HEAP_MON_HISTORY ? s_heap.num_samples
+                                                : HEAP_MON_HISTORY;
+  first = s_heap.num_samples - count;
+  mbuf_init(&buf, 32 + count * 40);
+  json_printf(&out, "[");
+  for (uint32_t i = first; i != s_heap.num_samples; i++) {
+    const struct heap_sample *s = &s_heap.history[i % HEAP_MON_HISTORY];
+    json_printf(&out, "%s[%u, %u, %u, %u]", (i != first ? ", " : ""),
+                (unsigned) s->uptime_s, (unsigned) s->free,
+                (unsigned) s->largest, (unsigned) s->sessions);
+  }
+  json_printf(&out, "]");
+  mg_rpc_send_responsef(
+      ri,
+      "{size: %u, free: %u, min_free: %u, largest: %u, min_largest: %u, "
+      "frag_pct: %d, warnings: %u, sessions: %d, format: %Q, history: %.*s}",
+      (unsigned) mgos_get_heap_size(), (unsigned) last->free,
+      (unsigned) s_heap.min_free, (unsigned) last->largest,
+      (unsigned) s_heap.min_largest, heap_mon_frag_pct(last),
+      (unsigned) s_heap.warnings, s_heap.num_sessions,
+      "[uptime_s, free, largest, sessions]", (int) buf.len, buf.buf);
+  mbuf_free(&buf);
+  (void) cb_arg;
+  (void) fi;
+  (void) args;
+}
+
+bool heap_mon_init(void) {
+  if (!mgos_sys_config_get_app_heap_enable()) return true;
+  heap_mon_sample();
+  mgos_set_timer(mgos_sys_config_get_app_heap_sample_ms(), MGOS_TIMER_REPEAT,
+                 heap_mon_timer_cb, NULL);
+  mg_rpc_add_handler(mgos_rpc_get_global(), "MelAC.Heap", "",
+                     heap_mon_rpc_handler, NULL);
+  return true;
+}
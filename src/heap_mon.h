@@ -0,0 +1,36 @@
+/*
+ * Copyright (c) 2014-2018 Cesanta Software Limited
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+
+/*
+ * Heap monitor.
+ *
+ * Samples free heap, the all-time minimum and the largest free block every
+ * app.heap.sample_ms and whenever the number of HAP sessions changes, and
+ * keeps the last HEAP_MON_HISTORY samples. A warning is logged once when
+ * fragmentation (share of free heap outside the largest block) reaches
+ * app.heap.frag_warn_pct, and re-armed when it drops below again.
+ * MelAC.Heap returns the current values and the history.
+ */
+
+bool heap_mon_init(void);
+
+/* Number of connected HAP sessions changed */
+void heap_mon_sessions(int num_sessions);
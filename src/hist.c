@@ -0,0 +1,79 @@
+/*
+ * Copyright (c) 2014-2018 Cesanta Software Limited
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "hist.h"
+
+#include <string.h>
+
+#define HIST_EXACT 16
+#define HIST_SUB_BITS 2
+
+static int hist_bucket(uint32_t us) {
+  if (us < HIST_EXACT) return us;
+  int e = 31 - __builtin_clz(us);
+  int sub = (us >> (e - HIST_SUB_BITS)) & ((1 << HIST_SUB_BITS) - 1);
+  return HIST_EXACT + ((e - 4) << HIST_SUB_BITS) + sub;
+}
+
+/* Middle of the bucket range */
+static uint32_t hist_bucket_value(int idx) {
+  if (idx < HIST_EXACT) return idx;
+  idx -= HIST_EXACT;
+  int e = (idx >> HIST_SUB_BITS) + 4;
+  int sub = idx & ((1 << HIST_SUB_BITS) - 1);
+  uint32_t width = 1UL << (e - HIST_SUB_BITS);
+  return (1UL << e) + sub * width + width / 2;
+}
+
+void hist_reset(struct hist *h) {
+  memset(h, 0, sizeof(*h));
+}
+
+void hist_add(struct hist *h, uint32_t us) {
+  h->buckets[hist_bucket(us)]++;
+  if (h->count == 0 || us < h->min_us) h->min_us = us;
+  if (us > h->max_us) h->max_us = us;
+  h->sum_us += us;
+  h->count++;
+}
+
+uint32_t hist_percentile(const struct hist *h, int pct) {
+  if (h->count == 0) return 0;
+  uint32_t rank = (uint32_t) (((uint64_t) h->count * pct + 99) / 100);
+  if (rank == 0) rank = 1;
+  uint32_t seen = 0;
+  for (int i = 0; i < HIST_NUM_BUCKETS; i++) {
+    seen += h->buckets[i];
+    if (seen >= rank) {
+      uint32_t v = hist_bucket_value(i);
+      if (v < h->min_us) v = h->min_us;
+      if (v > h->max_us) v = h->max_us;
+      return v;
+    }
+  }
+  return h->max_us;
+}
+
+int hist_json(struct json_out *out, va_list *ap) {
+  const struct hist *h = va_arg(*ap, const struct hist *);
+  return json_printf(
+      out, "{count: %u, min: %u, max: %u, mean: %u, p50: %u, p95: %u, p99: %u}",
+      (unsigned) h->count, (unsigned) h->min_us, (unsigned) h->max_us,
+      (unsigned) (h->count ? h->sum_us / h->count : 0),
+      (unsigned) hist_percentile(h, 50), (unsigned) hist_percentile(h, 95),
+      (unsigned) hist_percentile(h, 99));
+}
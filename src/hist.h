@@ -0,0 +1,50 @@
+/*
+ * Copyright (c) 2014-2018 Cesanta Software Limited
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stdarg.h>
+#include <stdint.h>
+
+#include "frozen.h"
+
+/*
+ * Latency histogram with logarithmic buckets: values below 16 us are exact,
+ * above that every power of two is split into 4 sub-buckets (12.5% error).
+ */
+#define HIST_NUM_BUCKETS 128
+
+struct hist {
+  uint32_t buckets[HIST_NUM_BUCKETS];
+  uint32_t count;
+  uint32_t min_us;
+  uint32_t max_us;
+  uint64_t sum_us;
+};
+
+void hist_reset(struct hist *h);
+
+void hist_add(struct hist *h, uint32_t us);
+
+/* Returns the approximate value at the given percentile (0..100) */
+uint32_t hist_percentile(const struct hist *h, int pct);
+
+/*
+ * json_printf() "%M" callback, takes a const struct hist *.
+ * Prints {count, min, max, mean, p50, p95, p99} in microseconds.
+ */
+int hist_json(struct json_out *out, va_list *ap);
@@ -0,0 +1,131 @@
+/*
+ * Copyright (c) 2014-2018 Cesanta Software Limited
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "mel_stats.h"
+
+#include <string.h>
+
+#include "hist.h"
+#include "mgos.h"
+#include "mgos_mel_ac.h"
+#include "mgos_rpc.h"
+
+static struct {
+  uint32_t tx;
+  uint32_t rx;
+  uint32_t crc_errors;
+  uint32_t connects;
+  uint32_t disconnects;
+  uint32_t connect_errors;
+  uint32_t params_set;
+  uint32_t params_not_set;
+  uint32_t events_suppressed;
+  uint32_t writes_skipped;
+  int64_t last_rx_us; /* 0 until the first packet */
+  int64_t write_us;   /* Oldest unconfirmed write, 0 if none */
+  struct hist apply;
+} s_stats;
+
+void mel_stats_write(void) {
+  if (s_stats.write_us == 0) s_stats.write_us = mgos_uptime_micros();
+}
+
+void mel_stats_event_suppressed(void) {
+  s_stats.events_suppressed++;
+}
+
+void mel_stats_write_skipped(void) {
+  s_stats.writes_skipped++;
+}
+
+void mel_stats_event(int ev, void *ev_data) {
+  switch (ev) {
+    case MGOS_MEL_AC_EV_CONNECTED:
+      if (*(bool *) ev_data) {
+        s_stats.connects++;
+      } else {
+        s_stats.disconnects++;
+        s_stats.write_us = 0;
+      }
+      break;
+    case MGOS_MEL_AC_EV_CONNECT_ERROR:
+      s_stats.connect_errors++;
+      break;
+    case MGOS_MEL_AC_EV_PACKET_WRITE:
+      s_stats.tx++;
+      break;
+    case MGOS_MEL_AC_EV_PACKET_READ:
+      s_stats.rx++;
+      s_stats.last_rx_us = mgos_uptime_micros();
+      break;
+    case MGOS_MEL_AC_EV_PACKET_READ_ERROR:
+      s_stats.crc_errors++;
+      break;
+    case MGOS_MEL_AC_EV_PARAMS_SET:
+      s_stats.params_set++;
+      if (s_stats.write_us != 0) {
+        hist_add(&s_stats.apply,
+                 (uint32_t) (mgos_uptime_micros() - s_stats.write_us));
+        s_stats.write_us = 0;
+      }
+      break;
+    case MGOS_MEL_AC_EV_PARAMS_NOT_SET:
+      s_stats.params_not_set++;
+      s_stats.write_us = 0;
+      break;
+  }
+}
+
+static void mel_stats_rpc_handler(struct mg_rpc_request_info *ri,
+                                  void *cb_arg, struct mg_rpc_frame_info *fi,
+                                  struct mg_str args) {
+  bool reset = false;
+  int last_rx_ms = -1;
+
+  json_scanf(args.p, args.len, ri->args_fmt, &reset);
+  if (s_stats.last_rx_us != 0) {
+    last_rx_ms = (int) ((mgos_uptime_micros() - s_stats.last_rx_us) / 1000);
+  }
+  mg_rpc_send_responsef(
+      ri,
+      "{connected: %B, uptime: %.1f, tx: %u, rx: %u, crc_errors: %u, "
+      "connects: %u, disconnects: %u, connect_errors: %u, params_set: %u, "
+      "params_not_set: %u, writes_skipped: %u, events_suppressed: %u, "
+      "last_rx_ms: %d, apply: %M}",
+      mgos_mel_ac_get_connected(), mgos_uptime(), (unsigned) s_stats.tx,
+      (unsigned) s_stats.rx, (unsigned) s_stats.crc_errors,
+      (unsigned) s_stats.connects, (unsigned) s_stats.disconnects,
+      (unsigned) s_stats.connect_errors, (unsigned) s_stats.params_set,
+      (unsigned) s_stats.params_not_set, (unsigned) s_stats.writes_skipped,
+      (unsigned) s_stats.events_suppressed, last_rx_ms, hist_json,
+      &s_stats.apply);
+  if (reset) {
+    int64_t last_rx_us = s_stats.last_rx_us;
+    memset(&s_stats, 0, sizeof(s_stats));
+    s_stats.last_rx_us = last_rx_us;
+    hist_reset(&s_stats.apply);
+  }
+  (void) cb_arg;
+  (void) fi;
+}
+
+bool mel_stats_init(void) {
+  hist_reset(&s_stats.apply);
+  mg_rpc_add_handler(mgos_rpc_get_global(), "MelAC.Stats", "{reset: %B}",
+                     mel_stats_rpc_handler, NULL);
+  return true;
+}
@@ -0,0 +1,45 @@
+/*
+ * Copyright (c) 2014-2018 Cesanta Software Limited
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+
+/*
+ * MEL-AC link health counters.
+ *
+ * mel_cb feeds every library event in; MelAC.Stats reports packets sent and
+ * received, checksum and connect errors, rejected writes, time since the
+ * last received packet, the apply latency (commit of staged HomeKit
+ * writes to MGOS_MEL_AC_EV_PARAMS_SET), HomeKit writes skipped as no-ops and
+ * HAP events the rate limiter dropped for a newer value. {reset: true}
+ * zeroes the counters after the response.
+ */
+
+bool mel_stats_init(void);
+
+/* Called from mel_cb for every MEL-AC event */
+void mel_stats_event(int ev, void *ev_data);
+
+/* New parameters were handed to the library */
+void mel_stats_write(void);
+
+/* A held back HAP event was replaced by a newer value before it was raised */
+void mel_stats_event_suppressed(void);
+
+/* A HomeKit write matched the current value and was not sent */
+void mel_stats_write_skipped(void);
@@ -0,0 +1,146 @@
+/*
+ * Copyright (c) 2014-2018 Cesanta Software Limited
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "trace.h"
+
+#include "common/mbuf.h"
+#include "mgos.h"
+#include "mgos_rpc.h"
+
+#ifndef TRACE_RING_LEN
+#define TRACE_RING_LEN 32
+#endif
+
+/* Header (5) + data (16) + checksum (1) */
+#define TRACE_FRAME_MAX 22
+
+#define TRACE_FLAG_TX (1 << 0)
+#define TRACE_FLAG_TRUNCATED (1 << 1)
+
+struct trace_entry {
+  uint32_t ms;
+  uint8_t flags;
+  uint8_t len;
+  uint8_t data[TRACE_FRAME_MAX];
+};
+
+static struct {
+  struct trace_entry ring[TRACE_RING_LEN];
+  uint32_t head; /* Total frames captured, next slot is head % LEN */
+  uint32_t read_errors;
+  bool enabled;
+} s_trace;
+
+static int trace_nibble(char c) {
+  if (c >= '0' && c <= '9') return c - '0';
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+  return -1;
+}
+
+int trace_decode(const char *hex, uint8_t *buf, int size) {
+  int len = 0, hi = -1;
+
+  for (const char *p = hex; *p != '\0'; p++) {
+    int v = trace_nibble(*p);
+    if (v < 0) continue;
+    if (hi < 0) {
+      hi = v;
+      continue;
+    }
+    if (len < size) buf[len] = (uint8_t) ((hi << 4) | v);
+    len++;
+    hi = -1;
+  }
+  return len;
+}
+
+void trace_packet(bool tx, const char *hex) {
+  struct trace_entry *e;
+  int len;
+
+  if (!s_trace.enabled || hex == NULL) return;
+  e = &s_trace.ring[s_trace.head++ % TRACE_RING_LEN];
+  e->ms = (uint32_t) (mgos_uptime_micros() / 1000);
+  e->flags = tx ? TRACE_FLAG_TX : 0;
+  len = trace_decode(hex, e->data, TRACE_FRAME_MAX);
+  if (len > TRACE_FRAME_MAX) {
+    e->flags |= TRACE_FLAG_TRUNCATED;
+    len = TRACE_FRAME_MAX;
+  }
+  e->len = (uint8_t) len;
+}
+
+void trace_read_error(void) {
+  s_trace.read_errors++;
+}
+
+static int trace_entry_json(struct json_out *out, va_list *ap) {
+  const struct trace_entry *e = va_arg(*ap, const struct trace_entry *);
+  static const char hex[] = "0123456789abcdef";
+  char buf[TRACE_FRAME_MAX * 2 + 1];
+  for (int i = 0; i < e->len; i++) {
+    buf[i * 2] = hex[e->data[i] >> 4];
+    buf[i * 2 + 1] = hex[e->data[i] & 0x0f];
+  }
+  buf[e->len * 2] = '\0';
+  return json_printf(out, "[%u, %Q, %B, %Q]", (unsigned) e->ms,
+                     (e->flags & TRACE_FLAG_TX) ? "tx" : "rx",
+                     (e->flags & TRACE_FLAG_TRUNCATED) != 0, buf);
+}
+
+static void trace_rpc_handler(struct mg_rpc_request_info *ri, void *cb_arg,
+                              struct mg_rpc_frame_info *fi,
+                              struct mg_str args) {
+  struct mbuf buf;
+  struct json_out out = JSON_OUT_MBUF(&buf);
+  bool clear = false;
+  uint32_t count = s_trace.head < TRACE_RING_LEN ? s_trace.head
+                                                 : TRACE_RING_LEN;
+
+  json_scanf(args.p, args.len, ri->args_fmt, &clear);
+  mbuf_init(&buf, 64 + count * (TRACE_FRAME_MAX * 2 + 24));
+  json_printf(&out, "[");
+  for (uint32_t i = s_trace.head - count; i != s_trace.head; i++) {
+    json_printf(&out, "%s%M", (i != s_trace.head - count ? ", " : ""),
+                trace_entry_json, &s_trace.ring[i % TRACE_RING_LEN]);
+  }
+  json_printf(&out, "]");
+  mg_rpc_send_responsef(ri,
+                        "{now_ms: %u, captured: %u, overwritten: %u, "
+                        "read_errors: %u, format: %Q, frames: %.*s}",
+                        (unsigned) (mgos_uptime_micros() / 1000),
+                        (unsigned) s_trace.head,
+                        (unsigned) (s_trace.head - count),
+                        (unsigned) s_trace.read_errors,
+                        "[ms, dir, truncated, hex]", (int) buf.len,
+                        buf.buf);
+  mbuf_free(&buf);
+  if (clear) {
+    s_trace.head = 0;
+    s_trace.read_errors = 0;
+  }
+  (void) cb_arg;
+  (void) fi;
+}
+
+bool trace_init(void) {
+  s_trace.enabled = mgos_sys_config_get_app_trace_enable();
+  mg_rpc_add_handler(mgos_rpc_get_global(), "MelAC.Trace", "{clear: %B}",
+                     trace_rpc_handler, NULL);
+  return true;
+}
@@ -0,0 +1,47 @@
+/*
+ * Copyright (c) 2014-2018 Cesanta Software Limited
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * UART packet trace.
+ *
+ * Every frame the MEL-AC library sends or receives is kept in binary form in
+ * a fixed ring (TRACE_RING_LEN entries) with its uptime in milliseconds and
+ * direction. The library drops frames with a bad checksum before reporting
+ * them, those are only counted. Capture is a hex decode and a copy, so it
+ * stays on in production (app.trace.enable). MelAC.Trace dumps the ring
+ * oldest first, {clear: true} empties it after the dump.
+ */
+
+bool trace_init(void);
+
+/* Frame as reported by MGOS_MEL_AC_EV_PACKET_WRITE / _PACKET_READ */
+void trace_packet(bool tx, const char *hex);
+
+/* MGOS_MEL_AC_EV_PACKET_READ_ERROR */
+void trace_read_error(void);
+
+/*
+ * Decodes a hex packet dump as reported by the library, separators are
+ * skipped. Stores up to size bytes, returns the number of bytes in the dump
+ * (more than size if it did not fit).
+ */
+int trace_decode(const char *hex, uint8_t *buf, int size);
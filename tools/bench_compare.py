@@ -0,0 +1,55 @@
+#!/usr/bin/env python3
+"""Compares two MelAC.Bench results.
+
+    mos call MelAC.Bench '{"runs": 60}' > run.json
+    tools/bench_compare.py baseline.json run.json [--max-regression 10]
+
+Prints p50/p95/p99 for every histogram and exits with status 1 when any
+p95 got worse than the baseline by more than --max-regression percent.
+"""
+
+import argparse
+import json
+import sys
+
+METRICS = ("write_to_tx", "write_to_set", "changed_to_event")
+PERCENTILES = ("p50", "p95", "p99")
+
+
+def load(path):
+    with open(path) as f:
+        data = json.load(f)
+    # "mos call" prints the result itself, raw RPC frames wrap it
+    return data.get("result", data)
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument("baseline")
+    parser.add_argument("run")
+    parser.add_argument("--max-regression", type=float, default=10.0,
+                        help="allowed p95 regression, percent")
+    args = parser.parse_args()
+
+    base, run = load(args.baseline), load(args.run)
+    failed = False
+    print("%-18s %-4s %10s %10s %8s" % ("metric", "", "baseline", "run", "delta"))
+    for metric in METRICS:
+        if metric not in base or metric not in run:
+            continue
+        for p in PERCENTILES:
+            b, r = base[metric][p], run[metric][p]
+            delta = (r - b) * 100.0 / b if b else 0.0
+            mark = ""
+            if p == "p95" and delta > args.max_regression:
+                mark = " !"
+                failed = True
+            print("%-18s %-4s %8.1fms %8.1fms %+7.1f%%%s" %
+                  (metric, p, b / 1000.0, r / 1000.0, delta, mark))
+    for key in ("skipped", "timeouts", "failures"):
+        print("%-18s %15d %10d" % (key, base.get(key, 0), run.get(key, 0)))
+    return 1 if failed else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,489 @@
+/*
+ * MEL-AC indoor unit emulator.
+ *
+ * Opens a pseudo-terminal and answers the CN105 packets sent by the mel-ac
+ * library, so the firmware can be run and benchmarked on a Linux host
+ * (mos.platform == "ubuntu") without a real Mitsubishi unit.
+ *
+ * Build:
+ *   cc -O2 -Wall -o mel_ac_emu tools/mel_ac_emu.c
+ *
+ * Usage:
+ *   mel_ac_emu [-b baud] [-r reply_ms] [-l link] [-- firmware args...]
+ *
+ * When a firmware command is given it is started with the pty slave as its
+ * stdin/stdout (UART0 on the host platform, see mos.yml). Otherwise the
+ * slave path is printed (and symlinked to <link> if requested).
+ *
+ * Commands read from stdin change the unit state the way the IR remote would:
+ *   power on|off, mode heat|dry|cool|fan|auto, temp <c>, room <c>,
+ *   fan <0..6>, vane <0..7>, wide <0..12>, operating 0|1,
+ *   drop <n> (ignore the next n SET packets), state
+ * and, when the emulator started the firmware:
+ *   restart (kill and start it again, like a power cut), boot
+ *   poll (GET packets and their mean interval since the last poll command)
+ *
+ * Every packet is reported on stdout as
+ *   <monotonic ms> <rx|tx> <type> <hex bytes>
+ * so runs can be correlated with the firmware benchmark output.
+ *
+ * Boot phases seen on the line are reported as
+ *   <monotonic ms> boot <phase> +<ms since the firmware was started>
+ * for the first packet, the connect handshake and the first settings reply
+ * (the firmware knows the HVAC state). Compare with MelAC.Boot.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#define PKT_HEADER 0xFC
+#define PKT_HEADER_LEN 5
+#define PKT_MAX_DATA 0x10
+#define PKT_MAX_LEN (PKT_HEADER_LEN + PKT_MAX_DATA + 1)
+
+#define PKT_TYPE_CONNECT 0x5A
+#define PKT_TYPE_CONNECTED 0x7A
+#define PKT_TYPE_SET 0x41
+#define PKT_TYPE_SET_ACK 0x61
+#define PKT_TYPE_GET 0x42
+#define PKT_TYPE_GET_REPLY 0x62
+
+#define INFO_SETTINGS 0x02
+#define INFO_ROOMTEMP 0x03
+#define INFO_STATUS 0x06
+
+#define SET_SETTINGS 0x01
+
+#define SET_FLAG_POWER 0x01
+#define SET_FLAG_MODE 0x02
+#define SET_FLAG_TEMP 0x04
+#define SET_FLAG_FAN 0x08
+#define SET_FLAG_VANE 0x10
+#define SET_FLAG2_WIDE 0x01
+
+static struct {
+  uint8_t power;
+  uint8_t mode;
+  float setpoint;
+  uint8_t fan;
+  uint8_t vane;
+  uint8_t wide;
+  float room;
+  uint8_t operating;
+} s_unit = {
+    .power = 0,
+    .mode = 0x08, /* auto */
+    .setpoint = 24.0f,
+    .fan = 0x00, /* auto */
+    .vane = 0x00,
+    .wide = 0x03,
+    .room = 23.5f,
+    .operating = 0,
+};
+
+static int s_baud = 2400;
+static int s_reply_ms = 0;
+static int s_drop_sets = 0;
+static int s_master = -1;
+static char s_slave_name[64];
+static char **s_fw_argv = NULL;
+static pid_t s_fw_pid = -1;
+
+enum boot_phase { BOOT_FIRST_RX, BOOT_CONNECTED, BOOT_SYNCED, BOOT_NUM_PHASES };
+static const char *const s_boot_names[BOOT_NUM_PHASES] = {
+    "first_rx", "connected", "synced"};
+static struct {
+  unsigned count;
+  double first_ms;
+  double last_ms;
+} s_poll;
+static double s_boot_start_ms;
+static double s_boot_ms[BOOT_NUM_PHASES];
+
+static const struct {
+  const char *name;
+  uint8_t code;
+} s_modes[] = {{"heat", 0x01}, {"dry", 0x02}, {"cool", 0x03}, {"fan", 0x07},
+               {"auto", 0x08}};
+
+static double now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+static uint8_t checksum(const uint8_t *buf, size_t len) {
+  uint8_t sum = 0;
+  for (size_t i = 0; i < len; i++) sum += buf[i];
+  return (uint8_t) (0xFC - sum);
+}
+
+static void boot_mark(enum boot_phase phase) {
+  if (s_boot_ms[phase] != 0) return;
+  s_boot_ms[phase] = now_ms();
+  printf("%.3f boot %s +%.0f\n", s_boot_ms[phase], s_boot_names[phase],
+         s_boot_ms[phase] - s_boot_start_ms);
+  fflush(stdout);
+}
+
+static void print_boot(void) {
+  for (int i = 0; i < BOOT_NUM_PHASES; i++) {
+    if (s_boot_ms[i] == 0) {
+      printf("%.3f boot %s -\n", now_ms(), s_boot_names[i]);
+    } else {
+      printf("%.3f boot %s +%.0f\n", s_boot_ms[i], s_boot_names[i],
+             s_boot_ms[i] - s_boot_start_ms);
+    }
+  }
+  fflush(stdout);
+}
+
+static void report(const char *dir, const uint8_t *buf, size_t len) {
+  printf("%.3f %s %02X", now_ms(), dir, len > 1 ? buf[1] : 0);
+  for (size_t i = 0; i < len; i++) printf("%s%02X", i ? "" : " ", buf[i]);
+  printf("\n");
+  fflush(stdout);
+}
+
+/* Sleeps for the time the frame would take on the wire at 8E1 */
+static void wire_delay(size_t len) {
+  if (s_baud <= 0) return;
+  useconds_t us = (useconds_t) (len * 11 * 1000000ULL / s_baud);
+  usleep(us);
+}
+
+static void send_packet(uint8_t type, const uint8_t *data, uint8_t len) {
+  uint8_t buf[PKT_MAX_LEN];
+  buf[0] = PKT_HEADER;
+  buf[1] = type;
+  buf[2] = 0x01;
+  buf[3] = 0x30;
+  buf[4] = len;
+  memcpy(buf + PKT_HEADER_LEN, data, len);
+  buf[PKT_HEADER_LEN + len] = checksum(buf, PKT_HEADER_LEN + len);
+  size_t total = PKT_HEADER_LEN + len + 1;
+  if (s_reply_ms > 0) usleep(s_reply_ms * 1000);
+  wire_delay(total);
+  if (write(s_master, buf, total) != (ssize_t) total) {
+    fprintf(stderr, "pty write: %s\n", strerror(errno));
+  }
+  report("tx", buf, total);
+}
+
+static uint8_t temp_to_idx(float t) {
+  int idx = 31 - (int) t;
+  if (idx < 0) idx = 0;
+  if (idx > 15) idx = 15;
+  return (uint8_t) idx;
+}
+
+static void handle_get(const uint8_t *data) {
+  uint8_t reply[PKT_MAX_DATA] = {0};
+  reply[0] = data[0];
+  switch (data[0]) {
+    case INFO_SETTINGS:
+      boot_mark(BOOT_SYNCED);
+      reply[3] = s_unit.power;
+      reply[4] = s_unit.mode;
+      reply[5] = temp_to_idx(s_unit.setpoint);
+      reply[6] = s_unit.fan;
+      reply[7] = s_unit.vane;
+      reply[10] = s_unit.wide;
+      reply[11] = (uint8_t) (s_unit.setpoint * 2 + 128);
+      break;
+    case INFO_ROOMTEMP:
+      reply[3] = (uint8_t) (s_unit.room - 10);
+      reply[6] = (uint8_t) (s_unit.room * 2 + 128);
+      break;
+    case INFO_STATUS:
+      reply[3] = s_unit.operating ? 0x20 : 0x00;
+      reply[4] = s_unit.operating;
+      break;
+    default:
+      break;
+  }
+  send_packet(PKT_TYPE_GET_REPLY, reply, sizeof(reply));
+}
+
+static void handle_set(const uint8_t *data) {
+  uint8_t ack[PKT_MAX_DATA] = {0};
+  if (s_drop_sets > 0) {
+    s_drop_sets--;
+    printf("%.3f drop SET\n", now_ms());
+    fflush(stdout);
+    return;
+  }
+  if (data[0] == SET_SETTINGS) {
+    if (data[1] & SET_FLAG_POWER) s_unit.power = data[3];
+    if (data[1] & SET_FLAG_MODE) s_unit.mode = data[4];
+    if (data[1] & SET_FLAG_TEMP) {
+      s_unit.setpoint =
+          data[14] ? (data[14] - 128) / 2.0f : (float) (31 - data[5]);
+    }
+    if (data[1] & SET_FLAG_FAN) s_unit.fan = data[6];
+    if (data[1] & SET_FLAG_VANE) s_unit.vane = data[7];
+    if (data[2] & SET_FLAG2_WIDE) s_unit.wide = data[13];
+    s_unit.operating = s_unit.power;
+  }
+  send_packet(PKT_TYPE_SET_ACK, ack, sizeof(ack));
+}
+
+static void handle_packet(const uint8_t *buf, size_t len) {
+  report("rx", buf, len);
+  boot_mark(BOOT_FIRST_RX);
+  const uint8_t *data = buf + PKT_HEADER_LEN;
+  switch (buf[1]) {
+    case PKT_TYPE_CONNECT: {
+      uint8_t ok = 0x00;
+      send_packet(PKT_TYPE_CONNECTED, &ok, 1);
+      boot_mark(BOOT_CONNECTED);
+      break;
+    }
+    case PKT_TYPE_GET:
+      if (s_poll.count++ == 0) s_poll.first_ms = now_ms();
+      s_poll.last_ms = now_ms();
+      handle_get(data);
+      break;
+    case PKT_TYPE_SET:
+      handle_set(data);
+      break;
+    default:
+      fprintf(stderr, "unknown packet type 0x%02X\n", buf[1]);
+      break;
+  }
+}
+
+/* Frame reassembly: bytes are accumulated until a full, valid packet */
+static void feed(uint8_t b) {
+  static uint8_t buf[PKT_MAX_LEN];
+  static size_t len = 0;
+  if (len == 0 && b != PKT_HEADER) return;
+  buf[len++] = b;
+  if (len < PKT_HEADER_LEN) return;
+  size_t need = PKT_HEADER_LEN + buf[4] + 1;
+  if (buf[4] > PKT_MAX_DATA) {
+    len = 0;
+    return;
+  }
+  if (len < need) return;
+  if (checksum(buf, need - 1) != buf[need - 1]) {
+    fprintf(stderr, "crc error, packet dropped\n");
+    report("crc", buf, need);
+  } else {
+    handle_packet(buf, need);
+  }
+  len = 0;
+}
+
+static void print_state(void) {
+  printf("%.3f state power=%u mode=0x%02X setpoint=%.1f fan=%u vane=%u "
+         "wide=%u room=%.1f operating=%u\n",
+         now_ms(), s_unit.power, s_unit.mode, s_unit.setpoint, s_unit.fan,
+         s_unit.vane, s_unit.wide, s_unit.room, s_unit.operating);
+  fflush(stdout);
+}
+
+static int spawn_firmware(void) {
+  pid_t pid = fork();
+  if (pid < 0) {
+    fprintf(stderr, "fork: %s\n", strerror(errno));
+    return -1;
+  }
+  if (pid == 0) {
+    setsid();
+    int slave = open(s_slave_name, O_RDWR);
+    if (slave < 0) _exit(EXIT_FAILURE);
+    dup2(slave, STDIN_FILENO);
+    dup2(slave, STDOUT_FILENO);
+    close(slave);
+    close(s_master);
+    execvp(s_fw_argv[0], s_fw_argv);
+    _exit(EXIT_FAILURE);
+  }
+  s_fw_pid = pid;
+  s_boot_start_ms = now_ms();
+  memset(s_boot_ms, 0, sizeof(s_boot_ms));
+  printf("%.3f boot start pid=%d\n", s_boot_start_ms, (int) pid);
+  fflush(stdout);
+  return 0;
+}
+
+/* Power cut: the firmware is killed without a chance to save anything */
+static void restart_firmware(void) {
+  if (s_fw_pid < 0) {
+    fprintf(stderr, "restart: no firmware command given\n");
+    return;
+  }
+  kill(s_fw_pid, SIGKILL);
+  waitpid(s_fw_pid, NULL, 0);
+  s_fw_pid = -1;
+  spawn_firmware();
+}
+
+static void handle_command(char *line) {
+  char cmd[16], arg[16];
+  int n = sscanf(line, "%15s %15s", cmd, arg);
+  if (n < 1) return;
+  if (n == 1 && strcmp(cmd, "state") == 0) {
+    print_state();
+    return;
+  }
+  if (n == 1 && strcmp(cmd, "poll") == 0) {
+    printf("%.3f poll gets=%u interval=%.0f\n", now_ms(), s_poll.count,
+           s_poll.count > 1
+               ? (s_poll.last_ms - s_poll.first_ms) / (s_poll.count - 1)
+               : 0.0);
+    fflush(stdout);
+    memset(&s_poll, 0, sizeof(s_poll));
+    return;
+  }
+  if (n == 1 && strcmp(cmd, "boot") == 0) {
+    print_boot();
+    return;
+  }
+  if (n == 1 && strcmp(cmd, "restart") == 0) {
+    restart_firmware();
+    return;
+  }
+  if (n != 2) goto usage;
+  if (strcmp(cmd, "power") == 0) {
+    s_unit.power = strcmp(arg, "on") == 0;
+    s_unit.operating = s_unit.power;
+  } else if (strcmp(cmd, "mode") == 0) {
+    size_t i;
+    for (i = 0; i < sizeof(s_modes) / sizeof(s_modes[0]); i++) {
+      if (strcmp(arg, s_modes[i].name) == 0) break;
+    }
+    if (i == sizeof(s_modes) / sizeof(s_modes[0])) goto usage;
+    s_unit.mode = s_modes[i].code;
+  } else if (strcmp(cmd, "temp") == 0) {
+    s_unit.setpoint = strtof(arg, NULL);
+  } else if (strcmp(cmd, "room") == 0) {
+    s_unit.room = strtof(arg, NULL);
+  } else if (strcmp(cmd, "fan") == 0) {
+    s_unit.fan = (uint8_t) atoi(arg);
+  } else if (strcmp(cmd, "vane") == 0) {
+    s_unit.vane = (uint8_t) atoi(arg);
+  } else if (strcmp(cmd, "wide") == 0) {
+    s_unit.wide = (uint8_t) atoi(arg);
+  } else if (strcmp(cmd, "operating") == 0) {
+    s_unit.operating = (uint8_t) atoi(arg);
+  } else if (strcmp(cmd, "drop") == 0) {
+    s_drop_sets = atoi(arg);
+  } else {
+    goto usage;
+  }
+  print_state();
+  return;
+
+usage:
+  fprintf(stderr, "unknown command: %s", line);
+}
+
+static int open_pty(char *slave_name, size_t size) {
+  int fd = posix_openpt(O_RDWR | O_NOCTTY);
+  if (fd < 0 || grantpt(fd) != 0 || unlockpt(fd) != 0) return -1;
+  if (ptsname_r(fd, slave_name, size) != 0) return -1;
+
+  /* Raw 8E1 line, same framing the library configures on the real UART */
+  int slave = open(slave_name, O_RDWR | O_NOCTTY);
+  if (slave < 0) return -1;
+  struct termios tio;
+  tcgetattr(slave, &tio);
+  cfmakeraw(&tio);
+  tio.c_cflag |= PARENB;
+  tio.c_cflag &= ~PARODD;
+  cfsetspeed(&tio, s_baud == 2400 ? B2400 : B9600);
+  tcsetattr(slave, TCSANOW, &tio);
+  close(slave);
+  return fd;
+}
+
+static void usage(const char *prog) {
+  fprintf(stderr,
+          "usage: %s [-b baud] [-r reply_ms] [-l link] [-- firmware args...]\n"
+          "  -b  simulated line rate, 0 disables wire delay (default 2400)\n"
+          "  -r  extra unit reply latency in ms (default 0)\n"
+          "  -l  create a symlink to the pty slave\n",
+          prog);
+  exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv) {
+  const char *link_name = NULL;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "b:r:l:h")) != -1) {
+    switch (opt) {
+      case 'b':
+        s_baud = atoi(optarg);
+        break;
+      case 'r':
+        s_reply_ms = atoi(optarg);
+        break;
+      case 'l':
+        link_name = optarg;
+        break;
+      default:
+        usage(argv[0]);
+    }
+  }
+
+  s_boot_start_ms = now_ms();
+  s_master = open_pty(s_slave_name, sizeof(s_slave_name));
+  if (s_master < 0) {
+    fprintf(stderr, "pty: %s\n", strerror(errno));
+    return EXIT_FAILURE;
+  }
+  fprintf(stderr, "MEL-AC emulator on %s, %d baud\n", s_slave_name, s_baud);
+  if (link_name != NULL) {
+    unlink(link_name);
+    if (symlink(s_slave_name, link_name) != 0) {
+      fprintf(stderr, "symlink %s: %s\n", link_name, strerror(errno));
+    }
+  }
+
+  if (optind < argc) {
+    s_fw_argv = argv + optind;
+    if (spawn_firmware() != 0) return EXIT_FAILURE;
+    signal(SIGCHLD, SIG_DFL);
+  }
+
+  struct pollfd fds[2] = {{.fd = s_master, .events = POLLIN},
+                          {.fd = STDIN_FILENO, .events = POLLIN}};
+  char line[128];
+  for (;;) {
+    if (poll(fds, 2, -1) < 0) {
+      if (errno == EINTR) continue;
+      break;
+    }
+    if (fds[0].revents & POLLIN) {
+      uint8_t buf[64];
+      ssize_t n = read(s_master, buf, sizeof(buf));
+      for (ssize_t i = 0; i < n; i++) feed(buf[i]);
+    } else if (fds[0].revents & (POLLHUP | POLLERR)) {
+      /* No reader on the slave side yet, avoid spinning */
+      usleep(100 * 1000);
+    }
+    if (fds[1].revents & POLLIN) {
+      if (fgets(line, sizeof(line), stdin) == NULL) {
+        fds[1].fd = -1;
+        continue;
+      }
+      handle_command(line);
+    }
+  }
+  return EXIT_SUCCESS;
+}